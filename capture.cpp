@@ -8,6 +8,8 @@
 #include <vector>
 #include <stdio.h>
 
+#include "detect.h"
+
 using namespace std;
 using namespace cv;
 
@@ -134,10 +136,8 @@ void detectAndDraw( Mat& img,
         pt2.y = pt1.y + r->height*scale;
         if(saveFace||sImg){
             captures++;
-            Mat faceRect = smallImg(*r);
-            Mat resFace( 100, 100, CV_8UC1 );
-            resize(faceRect, resFace, resFace.size(), 0, 0, INTER_LINEAR);
-            GaussianBlur( resFace, resFace, Size(7,7), 3 );
+            Mat resFace;
+            cropTrainingFace(smallImg, *r, resFace);
             imshow("result",resFace);
             String imageFName = captureDir;
             stringstream out;
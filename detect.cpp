@@ -0,0 +1,298 @@
+#include <math.h>
+#include <algorithm>
+
+#include "detect.h"
+
+// Never detect on fewer lines than this, or normal sized faces get lost.
+#define ADAPTIVE_MIN_LINES 240
+#define ADAPTIVE_MAX_SCALEFACTOR 1.4f
+#define ADAPTIVE_SCALEFACTOR_STEP 0.05f
+#define ADAPTIVE_MINSIZE_STEP 1.25f
+// Hysteresis band around the target, as a fraction of it.
+#define ADAPTIVE_SLOW 1.05
+#define ADAPTIVE_FAST 0.7
+
+void defaultDetectParams(detect_params *p)
+{
+    p->downscale = 1.0f;
+    p->scaleFactor = 1.2f;
+    p->minNeighbors = 2;
+    p->flags = cv::CascadeClassifier::SCALE_IMAGE;
+    p->minSize = cv::Size(20, 20);
+}
+
+// Greyscale and shrink img by p->downscale, returning the factor actually used.
+static float shrinkForDetection(const cv::Mat &img, cv::Mat &smallImg, const detect_params *p)
+{
+    cv::Mat greyImg;
+    float ds = p->downscale;
+
+    // Convert first, so the resize only has to touch one channel.
+    if (img.channels() > 1)
+        cv::cvtColor(img, greyImg, CV_BGR2GRAY);
+    else
+        greyImg = img;
+
+    if (ds > 1.0f) {
+        cv::Size smallSize(cvRound(img.cols / ds), cvRound(img.rows / ds));
+        cv::resize(greyImg, smallImg, smallSize, 0, 0, cv::INTER_LINEAR);
+        return ds;
+    }
+    smallImg = greyImg;
+    return 1.0f;
+}
+
+// Map rectangles found on the shrunk image back to frame coordinates.
+static void mapToFrame(std::vector<cv::Rect> &objects, float ds, cv::Size frameSize)
+{
+    cv::Rect bounds(0, 0, frameSize.width, frameSize.height);
+
+    if (ds <= 1.0f)
+        return;
+    for (size_t i = 0; i < objects.size(); i++) {
+        cv::Rect &r = objects[i];
+        r = cv::Rect(cvRound(r.x * ds), cvRound(r.y * ds),
+                     cvRound(r.width * ds), cvRound(r.height * ds)) & bounds;
+    }
+}
+
+// Detect faces in img, working on a reduced copy when p->downscale > 1.
+// The returned rectangles are in img coordinates.
+int detectFaces(cv::CascadeClassifier &detector, const cv::Mat &img,
+                std::vector<cv::Rect> &objects, const detect_params *p)
+{
+    cv::Mat smallImg;
+    float ds = shrinkForDetection(img, smallImg, p);
+
+    cv::Size minSize(cvRound(p->minSize.width / ds), cvRound(p->minSize.height / ds));
+    detector.detectMultiScale(smallImg, objects, p->scaleFactor, p->minNeighbors,
+                              p->flags, minSize);
+    mapToFrame(objects, ds, img.size());
+    return objects.size();
+}
+
+// Tiles are TILE_SIZE square (in level pixels) plus one window of overlap, and
+// a hit belongs to the tile whose core it starts in.  Must be even, so tiles
+// start on the 2 pixel grid detectMultiScale steps along on levels up to 2x.
+// That grid is only a starting point: after a stage-0 reject detectMultiScale
+// skips an extra step along the row, and a tile restarts that run at its own
+// left edge, so a tile can scan windows a full-frame pass skips and the other
+// way round.  Hits near such windows may differ; perf mode counts the frames
+// that still match serial detection.
+#define TILE_SIZE 128
+#define GROUP_EPS 0.2
+
+// One level of the scale pyramid.  Levels above 2x scale are small and use a
+// 1 pixel step in detectMultiScale, so they are scanned whole by letting the
+// cascade do its own resize with minSize == maxSize.
+typedef struct {
+    const cv::Mat *src;
+    double factor;
+    cv::Size winSize;
+    bool tiled;
+    float scaleFactor;
+    int flags;
+    cv::Mat img;
+} detect_level;
+
+typedef struct {
+    ParallelDetector *self;
+    detect_level *level;
+    cv::Rect tile;      // area of level->img to scan
+    cv::Rect core;      // hits starting outside it belong to a neighbouring tile
+    std::vector<cv::Rect> hits;
+} detect_job;
+
+ParallelDetector::ParallelDetector(const char *cascadeFile, WorkPool *workpool) : pool(workpool)
+{
+    cascades.resize(pool->size());
+    for (size_t i = 0; i < cascades.size(); i++)
+        cascades[i].load(cascadeFile);
+    if (!cascades[0].empty())
+        window = cascades[0].getOriginalWindowSize();
+}
+
+bool ParallelDetector::empty(void)
+{
+    for (size_t i = 0; i < cascades.size(); i++) {
+        if (cascades[i].empty())
+            return true;
+    }
+    return false;
+}
+
+static void resize_job(void *arg, int worker)
+{
+    detect_level *level = (detect_level *)arg;
+    cv::Size levelSize(cvRound(level->src->cols / level->factor),
+                       cvRound(level->src->rows / level->factor));
+
+    // Same interpolation detectMultiScale uses for SCALE_IMAGE.
+    if (levelSize == level->src->size())
+        level->img = *level->src;
+    else
+        cv::resize(*level->src, level->img, levelSize, 0, 0, cv::INTER_LINEAR);
+}
+
+void ParallelDetector::scan_job(void *arg, int worker)
+{
+    detect_job *job = (detect_job *)arg;
+    detect_level *level = job->level;
+    cv::CascadeClassifier &cascade = job->self->cascades[worker];
+    std::vector<cv::Rect> raw;
+
+    // minNeighbors 0 returns the raw hits, grouping is done after the merge.
+    if (!level->tiled) {
+        cascade.detectMultiScale(*level->src, job->hits, level->scaleFactor, 0,
+                                 level->flags, level->winSize, level->winSize);
+        return;
+    }
+
+    cv::Mat tileImg(level->img, job->tile);
+    cv::Size window = job->self->window;
+    cascade.detectMultiScale(tileImg, raw, level->scaleFactor, 0,
+                             level->flags, window, window);
+    for (size_t i = 0; i < raw.size(); i++) {
+        cv::Point pt(raw[i].x + job->tile.x, raw[i].y + job->tile.y);
+        if (!job->core.contains(pt))
+            continue;
+        job->hits.push_back(cv::Rect(cvRound(pt.x * level->factor), cvRound(pt.y * level->factor),
+                                     level->winSize.width, level->winSize.height));
+    }
+}
+
+int ParallelDetector::detect(const cv::Mat &img, std::vector<cv::Rect> &objects,
+                             const detect_params *p)
+{
+    cv::Mat smallImg;
+    std::vector<detect_level> levels;
+    std::vector<detect_job> jobs;
+    float ds = shrinkForDetection(img, smallImg, p);
+    cv::Size minSize(cvRound(p->minSize.width / ds), cvRound(p->minSize.height / ds));
+    size_t i;
+
+    // Walk the pyramid the same way detectMultiScale does.
+    for (double factor = 1; ; factor *= p->scaleFactor) {
+        detect_level level;
+        level.src = &smallImg;
+        level.factor = factor;
+        level.winSize = cv::Size(cvRound(window.width * factor), cvRound(window.height * factor));
+        level.tiled = factor <= 2.0;
+        level.scaleFactor = p->scaleFactor;
+        level.flags = p->flags;
+
+        if (level.winSize.width > smallImg.cols || level.winSize.height > smallImg.rows)
+            break;
+        if (level.winSize.width < minSize.width || level.winSize.height < minSize.height)
+            continue;
+        if (cvRound(smallImg.cols / factor) <= window.width ||
+            cvRound(smallImg.rows / factor) <= window.height)
+            break;
+        // An untiled scan covers every factor that rounds to its window size.
+        if (!level.tiled && !levels.empty() && levels.back().winSize == level.winSize) {
+            levels.back().tiled = false;
+            continue;
+        }
+        levels.push_back(level);
+    }
+
+    for (i = 0; i < levels.size(); i++) {
+        if (levels[i].tiled)
+            pool->submit(resize_job, &levels[i]);
+    }
+    pool->wait();
+
+    for (i = 0; i < levels.size(); i++) {
+        detect_level *level = &levels[i];
+        detect_job job;
+        job.self = this;
+        job.level = level;
+        if (!level->tiled) {
+            jobs.push_back(job);
+            continue;
+        }
+        cv::Rect bounds(0, 0, level->img.cols, level->img.rows);
+        for (int y = 0; y < level->img.rows; y += TILE_SIZE) {
+            for (int x = 0; x < level->img.cols; x += TILE_SIZE) {
+                job.core = cv::Rect(x, y, TILE_SIZE, TILE_SIZE);
+                job.tile = cv::Rect(x, y, TILE_SIZE + window.width + 1,
+                                    TILE_SIZE + window.height + 1) & bounds;
+                if (job.tile.width < window.width || job.tile.height < window.height)
+                    continue;
+                jobs.push_back(job);
+            }
+        }
+    }
+    for (i = 0; i < jobs.size(); i++)
+        pool->submit(scan_job, &jobs[i]);
+    pool->wait();
+
+    objects.clear();
+    for (i = 0; i < jobs.size(); i++)
+        objects.insert(objects.end(), jobs[i].hits.begin(), jobs[i].hits.end());
+    cv::groupRectangles(objects, p->minNeighbors, GROUP_EPS);
+    mapToFrame(objects, ds, img.size());
+    return objects.size();
+}
+
+// The training image of a face found on a frame: cut it out of the
+// histogram-equalized grey frame, scale it to 100x100 and blur it.  Every
+// tool that saves faces goes through here, so their crops match.
+void cropTrainingFace(const cv::Mat &equalized, const cv::Rect &face, cv::Mat &out)
+{
+    out.create(100, 100, CV_8UC1);
+    cv::resize(equalized(face), out, out.size(), 0, 0, cv::INTER_LINEAR);
+    cv::GaussianBlur(out, out, cv::Size(7, 7), 3);
+}
+
+void adaptiveInit(adaptive_ctl *ctl, int targetMs, const detect_params *p)
+{
+    ctl->targetMs = targetMs;
+    ctl->avgMs = -1;
+    ctl->base = *p;
+}
+
+// Feed the time the last detection took and retune p for the next frame.
+// When too slow, the frame is shrunk first since the cost follows the pixel
+// count, then the pyramid is coarsened, and only then are small faces given
+// up.  When there is headroom the steps are undone in reverse order, never
+// going past the base parameters.
+void adaptiveUpdate(adaptive_ctl *ctl, int ms, cv::Size frameSize, detect_params *p)
+{
+    const detect_params *base = &ctl->base;
+    float maxDownscale = std::max(1.0f, frameSize.height / (float)ADAPTIVE_MIN_LINES);
+    int maxMinSize = frameSize.height / 4;
+    double ratio;
+
+    if (ctl->avgMs < 0)
+        ctl->avgMs = ms;
+    else
+        ctl->avgMs = 0.7 * ctl->avgMs + 0.3 * ms;
+    ratio = ctl->avgMs / std::max(1, ctl->targetMs);
+
+    if (ratio > ADAPTIVE_SLOW) {
+        if (p->downscale < maxDownscale) {
+            p->downscale *= (float)std::min(1.5, sqrt(ratio));
+            p->downscale = std::min(p->downscale, maxDownscale);
+        } else if (p->scaleFactor < ADAPTIVE_MAX_SCALEFACTOR) {
+            p->scaleFactor = std::min(p->scaleFactor + ADAPTIVE_SCALEFACTOR_STEP,
+                                      ADAPTIVE_MAX_SCALEFACTOR);
+        } else if (p->minSize.height < maxMinSize) {
+            p->minSize.width = cvRound(p->minSize.width * ADAPTIVE_MINSIZE_STEP);
+            p->minSize.height = cvRound(p->minSize.height * ADAPTIVE_MINSIZE_STEP);
+        }
+    } else if (ratio < ADAPTIVE_FAST) {
+        if (p->minSize.height > base->minSize.height) {
+            p->minSize.width = std::max(base->minSize.width,
+                                        cvRound(p->minSize.width / ADAPTIVE_MINSIZE_STEP));
+            p->minSize.height = std::max(base->minSize.height,
+                                         cvRound(p->minSize.height / ADAPTIVE_MINSIZE_STEP));
+        } else if (p->scaleFactor > base->scaleFactor) {
+            p->scaleFactor = std::max(p->scaleFactor - ADAPTIVE_SCALEFACTOR_STEP,
+                                      base->scaleFactor);
+        } else if (p->downscale > base->downscale) {
+            p->downscale = std::max(p->downscale / (float)std::min(1.5, sqrt(1.0 / ratio)),
+                                    base->downscale);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __detect_h__
+#define __detect_h__
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "workpool.h"
+
+// Parameters for a Haar detection pass.  The frame is shrunk by downscale
+// before detectMultiScale, and minSize is given in full-resolution pixels.
+typedef struct {
+    float downscale;
+    float scaleFactor;
+    int minNeighbors;
+    int flags;
+    cv::Size minSize;
+} detect_params;
+
+// State for the adaptive controller, which retunes detect_params after every
+// frame so that detection holds a target latency.
+typedef struct {
+    int targetMs;
+    double avgMs;
+    detect_params base;
+} adaptive_ctl;
+
+// Haar detection spread over a WorkPool.  Each pyramid level is cut into
+// overlapping tiles that are scanned at the cascade's native window size; the
+// raw hits are merged with groupRectangles as detectMultiScale does.  Tiles
+// don't reproduce detectMultiScale's skipping of windows after a reject, so
+// the result can differ slightly from a single-threaded detection of the
+// same frame; perf mode reports how many frames match.
+class ParallelDetector {
+    public:
+        ParallelDetector(const char *cascadeFile, WorkPool *pool);
+        bool empty(void);
+        int detect(const cv::Mat &img, std::vector<cv::Rect> &objects, const detect_params *p);
+        int threads(void) { return pool->size(); }
+    private:
+        WorkPool *pool;
+        std::vector<cv::CascadeClassifier> cascades;   // one per worker
+        cv::Size window;
+
+        static void scan_job(void *arg, int worker);
+};
+
+void defaultDetectParams(detect_params *p);
+int detectFaces(cv::CascadeClassifier &detector, const cv::Mat &img,
+                std::vector<cv::Rect> &objects, const detect_params *p);
+void cropTrainingFace(const cv::Mat &equalized, const cv::Rect &face, cv::Mat &out);
+void adaptiveInit(adaptive_ctl *ctl, int targetMs, const detect_params *p);
+void adaptiveUpdate(adaptive_ctl *ctl, int ms, cv::Size frameSize, detect_params *p);
+
+#endif
@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "enroll.h"
+
+// Faces waiting for the writer past this many are turned away rather than
+// letting a stalled disk grow the queue without bound.
+#define MAX_QUEUED 256
+// How long a writer transaction waits on another connection's lock.
+#define BUSY_TIMEOUT_MS 5000
+
+Enroller::Enroller(const char *dbfile, const char *dir) : dbname(dbfile), dir(dir)
+{
+    db = NULL;
+    findPerson = addPerson = addPicture = NULL;
+    running = false;
+    inflight = 0;
+    stopping = false;
+    queued = written = failed = dropped = batches = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&work_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+}
+
+// Writes out whatever is still queued before returning.
+Enroller::~Enroller()
+{
+    if (running) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&work_cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thread, NULL);
+    }
+    closedb();
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&work_cond);
+    pthread_mutex_destroy(&lock);
+}
+
+int Enroller::opendb(void)
+{
+    char *err;
+
+    if (sqlite3_open(dbname, &db) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database %s: %s\n", dbname, sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    // WAL lets the recognizer's connection keep reading while we commit,
+    // and NORMAL only syncs at checkpoints.
+    if (sqlite3_exec(db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = 1;",
+                     NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "Can't set up database %s: %s\n", dbname, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT id FROM names WHERE name = ?;", -1, &findPerson, NULL) ||
+        sqlite3_prepare_v2(db, "INSERT INTO names VALUES (NULL, ?);", -1, &addPerson, NULL) ||
+        sqlite3_prepare_v2(db, "INSERT INTO pictures VALUES (?, ?);", -1, &addPicture, NULL)) {
+        fprintf(stderr, "Can't prepare enrollment statements: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+void Enroller::closedb(void)
+{
+    sqlite3_finalize(findPerson);
+    sqlite3_finalize(addPerson);
+    sqlite3_finalize(addPicture);
+    findPerson = addPerson = addPicture = NULL;
+    if (db)
+        sqlite3_close(db);
+    db = NULL;
+}
+
+int Enroller::start(void)
+{
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Can't create directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (opendb())
+        return -1;
+    if (pthread_create(&thread, NULL, writer_main, this)) {
+        fprintf(stderr, "Failed to start enrollment writer\n");
+        return -1;
+    }
+    running = true;
+    return 0;
+}
+
+// Queue the face at face on frame for name.  The whole frame is kept, since
+// it is equalized before the face is cut out.  Never waits on I/O: returns
+// -1 at once if the writer has fallen MAX_QUEUED faces behind.
+int Enroller::enroll(const char *name, const cv::Mat &frame, const cv::Rect &face, enroll_cb cb, void *data)
+{
+    enroll_job *job = new enroll_job;
+
+    job->name = name;
+    job->frame = frame.clone();
+    job->face = face;
+    job->cb = cb;
+    job->data = data;
+
+    pthread_mutex_lock(&lock);
+    if (!running || stopping || queue.size() >= MAX_QUEUED) {
+        dropped++;
+        pthread_mutex_unlock(&lock);
+        delete job;
+        return -1;
+    }
+    queue.push_back(job);
+    queued++;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+// Block until everything enrolled so far is committed.
+void Enroller::flush(void)
+{
+    pthread_mutex_lock(&lock);
+    while (!queue.empty() || inflight > 0)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void Enroller::report(void)
+{
+    pthread_mutex_lock(&lock);
+    printf("Enrollment: %d queued, %d written in %d transactions, %d failed, %d dropped\n",
+           queued, written, batches, failed, dropped);
+    pthread_mutex_unlock(&lock);
+}
+
+// Crop the face as capture and extract do, under a name no other save can
+// take.
+int Enroller::saveImage(enroll_job *job, std::string &filename)
+{
+    cv::Mat grey, equalized, resFace;
+
+    if (job->frame.channels() > 1)
+        cv::cvtColor(job->frame, grey, CV_BGR2GRAY);
+    else
+        grey = job->frame;
+    cv::equalizeHist(grey, equalized);
+    cropTrainingFace(equalized, job->face, resFace);
+
+    filename = faceFilename(dir, job->name.c_str());
+    if (!cv::imwrite(filename, resFace)) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int Enroller::insertRows(enroll_job *job, const char *filename)
+{
+    sqlite3_int64 id = -1;
+
+    sqlite3_bind_text(findPerson, 1, job->name.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(findPerson) == SQLITE_ROW)
+        id = sqlite3_column_int64(findPerson, 0);
+    sqlite3_reset(findPerson);
+    if (id < 0) {
+        sqlite3_bind_text(addPerson, 1, job->name.c_str(), -1, SQLITE_TRANSIENT);
+        int ret = sqlite3_step(addPerson);
+        sqlite3_reset(addPerson);
+        if (ret != SQLITE_DONE)
+            return -1;
+        id = sqlite3_last_insert_rowid(db);
+    }
+    sqlite3_bind_int64(addPicture, 1, id);
+    sqlite3_bind_text(addPicture, 2, filename, -1, SQLITE_TRANSIENT);
+    int ret = sqlite3_step(addPicture);
+    sqlite3_reset(addPicture);
+    return ret == SQLITE_DONE ? 0 : -1;
+}
+
+// Save the images first so the transaction only covers the inserts, then
+// commit the batch and report back.
+void Enroller::writeBatch(std::deque<enroll_job *> &batch)
+{
+    std::vector<std::string> filenames(batch.size());
+    std::vector<int> status(batch.size());
+    size_t i;
+    int ok = 0;
+
+    for (i = 0; i < batch.size(); i++)
+        status[i] = saveImage(batch[i], filenames[i]);
+
+    bool committed = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+    for (i = 0; i < batch.size() && committed; i++) {
+        if (status[i] == 0)
+            status[i] = insertRows(batch[i], filenames[i].c_str());
+    }
+    if (committed && sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        committed = false;
+    }
+    if (!committed)
+        fprintf(stderr, "Enrollment transaction failed: %s\n", sqlite3_errmsg(db));
+
+    for (i = 0; i < batch.size(); i++) {
+        enroll_job *job = batch[i];
+        if (!committed)
+            status[i] = -1;
+        if (status[i] != 0 && !filenames[i].empty())
+            unlink(filenames[i].c_str());
+        if (status[i] == 0)
+            ok++;
+        if (job->cb)
+            job->cb(status[i], job->name.c_str(), filenames[i].c_str(), job->data);
+        delete job;
+    }
+
+    pthread_mutex_lock(&lock);
+    written += ok;
+    failed += batch.size() - ok;
+    batches++;
+    inflight -= batch.size();
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void *Enroller::writer_main(void *arg)
+{
+    Enroller *e = (Enroller *)arg;
+    std::deque<enroll_job *> batch;
+
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        while (e->queue.empty() && !e->stopping)
+            pthread_cond_wait(&e->work_cond, &e->lock);
+        if (e->queue.empty())
+            break;
+        // Everything that queued up while the last batch was being written
+        // goes into one transaction.
+        batch.swap(e->queue);
+        e->inflight += batch.size();
+        pthread_mutex_unlock(&e->lock);
+
+        e->writeBatch(batch);
+        batch.clear();
+
+        pthread_mutex_lock(&e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
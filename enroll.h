@@ -0,0 +1,60 @@
+#ifndef __enroll_h__
+#define __enroll_h__
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <deque>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+#include "detect.h"
+#include "trainer.h"
+
+// Called on the writer thread once a face is on disk and in the database
+// (status 0), or has failed.  filename is only valid during the call.
+typedef void(*enroll_cb)(int status, const char *name, const char *filename, void *data);
+
+typedef struct {
+    std::string name;
+    cv::Mat frame;      // the caller's frame, copied
+    cv::Rect face;      // where the face is on it
+    enroll_cb cb;
+    void *data;
+} enroll_job;
+
+// Adds faces to the training database without making the caller wait on
+// disk.  enroll() only copies the frame onto a queue; a writer thread with
+// its own connection preprocesses and saves the images, then inserts the
+// rows in one WAL transaction per batch of whatever has queued up.
+class Enroller {
+    public:
+        Enroller(const char *dbfile, const char *dir);
+        ~Enroller();
+        int start(void);
+        int enroll(const char *name, const cv::Mat &frame, const cv::Rect &face, enroll_cb cb, void *data);
+        void flush(void);
+        void report(void);
+    private:
+        const char *dbname;
+        const char *dir;
+        sqlite3 *db;
+        sqlite3_stmt *findPerson, *addPerson, *addPicture;
+        pthread_t thread;
+        bool running;
+        pthread_mutex_t lock;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        std::deque<enroll_job *> queue;
+        int inflight;       // taken off the queue, not yet committed
+        bool stopping;
+        int queued, written, failed, dropped, batches;
+
+        int opendb(void);
+        void closedb(void);
+        int saveImage(enroll_job *job, std::string &filename);
+        int insertRows(enroll_job *job, const char *filename);
+        void writeBatch(std::deque<enroll_job *> &batch);
+        static void *writer_main(void *arg);
+};
+
+#endif
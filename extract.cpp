@@ -0,0 +1,262 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "detect.h"
+#include "trainer.h"
+#include "workpool.h"
+
+// Longest faces.txt line Trainer::loadDbFromList reads whole, newline and all.
+#define LIST_LINE_MAX 255
+
+// Headless replacement for capture + generateFacesTxt.py: finds every face in
+// a tree of photos laid out as <root>/<person>/<photo>, writes the 100x100
+// crops to <out>/<person>/ and lists them in faces.txt.
+
+typedef struct {
+    std::string person;
+    std::string path;
+    int personNumber;
+    std::vector<std::string> faces;     // crops written for this photo
+    bool failed;
+} extract_job;
+
+typedef struct {
+    std::vector<cv::CascadeClassifier> cascades;    // one per worker
+    const char *outdir;
+    int maxFaces;
+} extract_ctx;
+
+static extract_ctx ctx;
+
+static int is_dir(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int make_dir(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0755) && errno != EEXIST) {
+        fprintf(stderr, "Can't create directory %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// List the non-hidden entries of a directory, sorted so runs are repeatable.
+static std::vector<std::string> list_dir(const std::string &path)
+{
+    std::vector<std::string> names;
+    DIR *dirp;
+    struct dirent *entry;
+
+    if ((dirp = opendir(path.c_str()))) {
+        while ((entry = readdir(dirp))) {
+            if (entry->d_name[0] != '.')
+                names.push_back(entry->d_name);
+        }
+        closedir(dirp);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// Decode, equalize, detect and crop one photo.
+static void extract_faces(void *arg, int worker)
+{
+    extract_job *job = (extract_job *)arg;
+    cv::CascadeClassifier &cascade = ctx.cascades[worker];
+    std::vector<cv::Rect> faces;
+    cv::Mat img, gray;
+
+    img = cv::imread(job->path, CV_LOAD_IMAGE_GRAYSCALE);
+    if (!img.data) {
+        job->failed = true;
+        return;
+    }
+    cv::equalizeHist(img, gray);
+    cascade.detectMultiScale(gray, faces, 1.1, 2, CV_HAAR_SCALE_IMAGE, cv::Size(30, 30));
+
+    // Keep the extension, so a.jpg and a.png don't write the same crops.
+    std::string base = job->path.substr(job->path.rfind('/') + 1);
+    for (size_t i = 0; i < faces.size() && (int)i < ctx.maxFaces; i++) {
+        cv::Mat resFace;
+        char suffix[32];
+
+        cropTrainingFace(gray, faces[i], resFace);
+        snprintf(suffix, sizeof(suffix), "_%zu.pgm", i);
+        std::string name = std::string(ctx.outdir) + "/" + job->person + "/" + base + suffix;
+        if (!cv::imwrite(name, resFace)) {
+            job->failed = true;
+            continue;
+        }
+        job->faces.push_back(name);
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [--haarfile file] [--out dir] [--picsfile file] [--db file]\n"
+                    "    [--threads n] [--maxfaces n] photodir\n", prog);
+    fprintf(stderr, "photodir holds one directory of photos per person.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int option_index;
+
+    const char *haarfile = "data/haarcascades/haarcascade_frontalface_alt.xml";
+    const char *picsfile = "faces.txt";
+    const char *dbname = NULL;
+    int threads = 0;
+
+    ctx.outdir = "data/captured";
+    ctx.maxFaces = 1;
+
+    static struct option long_options[] = {
+        {"haarfile", required_argument, NULL, 'h'},
+        {"picsfile", required_argument, NULL, 'p'},
+        {"out", required_argument, NULL, 'o'},
+        {"db", required_argument, NULL, 'b'},
+        {"threads", required_argument, NULL, 'j'},
+        {"maxfaces", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    while (1) {
+        c = getopt_long(argc, argv, "h:p:o:b:j:m:", long_options, &option_index);
+        if (c == -1) break;
+
+        switch (c) {
+            case 'h':
+                haarfile = optarg;
+                break;
+            case 'p':
+                picsfile = optarg;
+                break;
+            case 'o':
+                ctx.outdir = optarg;
+                break;
+            case 'b':
+                dbname = optarg;
+                break;
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                ctx.maxFaces = strtol(optarg, NULL, 10);
+                break;
+            case '?':
+                usage(argv[0]);
+                break;
+            default:
+                abort();
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    std::string root = argv[optind];
+    std::vector<extract_job> jobs;
+    std::vector<std::string> people = list_dir(root);
+    int personNumber = 0;
+
+    if (make_dir(ctx.outdir))
+        exit(1);
+    for (size_t i = 0; i < people.size(); i++) {
+        std::string dir = root + "/" + people[i];
+        if (!is_dir(dir))
+            continue;
+        // faces.txt is comma separated, and a name can't be quoted there.
+        if (people[i].find(',') != std::string::npos) {
+            fprintf(stderr, "Skipping %s: person names can't contain a comma\n", dir.c_str());
+            continue;
+        }
+        personNumber++;
+        if (make_dir(std::string(ctx.outdir) + "/" + people[i]))
+            exit(1);
+        std::vector<std::string> photos = list_dir(dir);
+        for (size_t j = 0; j < photos.size(); j++) {
+            extract_job job;
+            job.person = people[i];
+            job.path = dir + "/" + photos[j];
+            job.personNumber = personNumber;
+            job.failed = false;
+            jobs.push_back(job);
+        }
+    }
+    printf("Found %zu photos of %d people in %s\n", jobs.size(), personNumber, root.c_str());
+
+    WorkPool pool(threads);
+    ctx.cascades.resize(pool.size());
+    for (int i = 0; i < pool.size(); i++) {
+        if (!ctx.cascades[i].load(haarfile)) {
+            fprintf(stderr, "ERROR: Could not load classifier cascade\n");
+            exit(1);
+        }
+    }
+
+    int64_t start = cv::getTickCount();
+    for (size_t i = 0; i < jobs.size(); i++)
+        pool.submit(extract_faces, &jobs[i]);
+    pool.wait();
+    double secs = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    // Written in directory order, whatever order the workers finished in.
+    FILE *facesTxt = fopen(picsfile, "w");
+    int nfaces = 0, nfailed = 0, nempty = 0, nlong = 0;
+    if (!facesTxt) {
+        fprintf(stderr, "Can't open file %s\n", picsfile);
+        exit(1);
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        extract_job &job = jobs[i];
+        if (job.failed)
+            nfailed++;
+        else if (job.faces.empty())
+            nempty++;
+        for (size_t j = 0; j < job.faces.size(); j++) {
+            char line[LIST_LINE_MAX + 2];
+            int len = snprintf(line, sizeof(line), "%d,%s,%s\n",
+                               job.personNumber, job.person.c_str(), job.faces[j].c_str());
+            if (len > LIST_LINE_MAX) {
+                fprintf(stderr, "Skipping %s: path too long for %s\n", job.faces[j].c_str(), picsfile);
+                unlink(job.faces[j].c_str());
+                nlong++;
+                continue;
+            }
+            fputs(line, facesTxt);
+            nfaces++;
+        }
+    }
+    fclose(facesTxt);
+
+    printf("Extracted %d faces from %zu photos in %.2f s with %d threads "
+           "(%.1f photos/s, %.1f faces/s)\n",
+           nfaces, jobs.size(), secs, pool.size(),
+           secs > 0 ? jobs.size() / secs : 0.0, secs > 0 ? nfaces / secs : 0.0);
+    if (nfailed || nempty)
+        printf("%d photos failed to load or save, %d had no face\n", nfailed, nempty);
+    if (nlong)
+        printf("%d faces left out of %s for their path length\n", nlong, picsfile);
+
+    if (dbname) {
+        Trainer t(dbname);
+        if (t.loadDbFromList(picsfile) <= 0)
+            exit(1);
+    }
+    return 0;
+}
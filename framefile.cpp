@@ -0,0 +1,166 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "framefile.h"
+
+#define FRAMEFILE_MAGIC "FRAMES01"
+
+typedef struct {
+    int64_t timestamp;  // microseconds since the first frame
+    uint32_t length;
+} frame_header;
+
+static int64_t ticksToUs(int64_t ticks)
+{
+    return (int64_t)(ticks * 1000000.0 / cv::getTickFrequency());
+}
+
+FrameRecorder::FrameRecorder() : fp(NULL), count(0), startTicks(0)
+{
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+int FrameRecorder::open(const char *filename, int quality)
+{
+    close();
+    if (!(fp = fopen(filename, "wb"))) {
+        fprintf(stderr, "Can\'t open file %s\n", filename);
+        return -1;
+    }
+    fwrite(FRAMEFILE_MAGIC, 1, strlen(FRAMEFILE_MAGIC), fp);
+    params.clear();
+    params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    params.push_back(quality);
+    count = 0;
+    return 0;
+}
+
+int FrameRecorder::write(const cv::Mat &frame)
+{
+    frame_header hdr;
+    int64_t now = cv::getTickCount();
+
+    if (!fp)
+        return -1;
+    if (count == 0)
+        startTicks = now;
+    if (!cv::imencode(".jpg", frame, buf, params))
+        return -1;
+    hdr.timestamp = ticksToUs(now - startTicks);
+    hdr.length = buf.size();
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(&buf[0], 1, buf.size(), fp) != buf.size()) {
+        perror("Recording frame");
+        return -1;
+    }
+    count++;
+    return 0;
+}
+
+void FrameRecorder::close(void)
+{
+    if (fp) {
+        fclose(fp);
+        printf("Recorded %d frames\n", count);
+    }
+    fp = NULL;
+}
+
+ReplayCapture::ReplayCapture() : fp(NULL), paced(false), count(0), startTicks(0), lastTimestamp(0)
+{
+}
+
+ReplayCapture::~ReplayCapture()
+{
+    release();
+}
+
+bool ReplayCapture::openReplay(const char *filename, bool pace)
+{
+    char magic[sizeof(FRAMEFILE_MAGIC) - 1];
+
+    release();
+    if (!(fp = fopen(filename, "rb")))
+        return false;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, FRAMEFILE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s is not a recorded session\n", filename);
+        release();
+        return false;
+    }
+    paced = pace;
+    count = 0;
+    return true;
+}
+
+bool ReplayCapture::isOpened() const
+{
+    return fp != NULL;
+}
+
+void ReplayCapture::release()
+{
+    if (fp)
+        fclose(fp);
+    fp = NULL;
+}
+
+// Read the next record, and with pacing wait until it is due.
+bool ReplayCapture::grab()
+{
+    frame_header hdr;
+
+    if (!fp || fread(&hdr, sizeof(hdr), 1, fp) != 1)
+        return false;
+    buf.resize(hdr.length);
+    if (hdr.length == 0 || fread(&buf[0], 1, hdr.length, fp) != hdr.length)
+        return false;
+
+    if (count == 0)
+        startTicks = cv::getTickCount();
+    if (paced) {
+        int64_t wait = hdr.timestamp - ticksToUs(cv::getTickCount() - startTicks);
+        if (wait > 0)
+            usleep(wait);
+    }
+    lastTimestamp = hdr.timestamp;
+    count++;
+    return true;
+}
+
+bool ReplayCapture::retrieve(cv::Mat &image, int channel)
+{
+    if (buf.empty())
+        return false;
+    image = cv::imdecode(cv::Mat(1, buf.size(), CV_8UC1, &buf[0]), CV_LOAD_IMAGE_UNCHANGED);
+    return !image.empty();
+}
+
+bool ReplayCapture::read(cv::Mat &image)
+{
+    if (!grab()) {
+        image.release();
+        return false;
+    }
+    return retrieve(image);
+}
+
+cv::VideoCapture& ReplayCapture::operator >> (cv::Mat &image)
+{
+    read(image);
+    return *this;
+}
+
+// Only the position of the last frame is known without a scan of the file.
+double ReplayCapture::get(int propId)
+{
+    if (propId == CV_CAP_PROP_POS_MSEC)
+        return lastTimestamp / 1000.0;
+    if (propId == CV_CAP_PROP_POS_FRAMES)
+        return count;
+    return 0;
+}
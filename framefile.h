@@ -0,0 +1,52 @@
+#ifndef __framefile_h__
+#define __framefile_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Recorded sessions are a small header followed by one record per frame:
+// the capture time in microseconds since the first frame, the length of the
+// encoded image, then the image itself (JPEG by default).
+
+class FrameRecorder {
+    public:
+        FrameRecorder();
+        ~FrameRecorder();
+        int open(const char *filename, int quality);
+        int write(const cv::Mat &frame);
+        void close(void);
+        int frames(void) { return count; }
+    private:
+        FILE *fp;
+        int count;
+        int64_t startTicks;
+        std::vector<int> params;
+        std::vector<unsigned char> buf;
+};
+
+// Plays a recorded session back through the VideoCapture interface, either
+// at the recorded pace or as fast as it can be decoded.
+class ReplayCapture : public cv::VideoCapture {
+    public:
+        ReplayCapture();
+        virtual ~ReplayCapture();
+        bool openReplay(const char *filename, bool paced);
+        virtual bool isOpened() const;
+        virtual void release();
+        virtual bool grab();
+        virtual bool retrieve(cv::Mat &image, int channel = 0);
+        virtual bool read(cv::Mat &image);
+        virtual cv::VideoCapture& operator >> (cv::Mat &image);
+        virtual double get(int propId);
+    private:
+        FILE *fp;
+        bool paced;
+        int count;
+        int64_t startTicks;
+        int64_t lastTimestamp;
+        std::vector<unsigned char> buf;
+};
+
+#endif
@@ -2,11 +2,36 @@
 #include <stdlib.h>
 #include <vector>
 #include <errno.h>
+#include <algorithm>
 
 #include <opencv2/opencv.hpp>
 
 #include "timer.h"
+#include "detect.h"
 #include "recognizer.h"
+#include "streams.h"
+#include "videosrc.h"
+#include "framefile.h"
+#include "shmring.h"
+#include "enroll.h"
+#include "shards.h"
+
+#define SHM_SLOTS 8
+// Enroll at most one face per this many ms, so a few seconds in front of the
+// camera gives a handful of different shots rather than a burst of copies.
+#define ENROLL_INTERVAL_MS 500
+
+// Options shared by the single camera loops.
+typedef struct {
+    int gui;
+    FrameRecorder *recorder;    // save every frame read, if set
+    FILE *dump;                 // one line of results per frame, if set
+    int topk;                   // list this many candidate people per face
+    Enroller *enroller;         // add faces seen as enrollName, if set
+    const char *enrollName;
+    int64_t startTicks;         // report the time to the first frame from here, if set
+    ShardedGallery *shards;     // search these instead of the local gallery, if set
+} session_opts;
 
 void drawRectangle(cv::Mat img, cv::Rect faceRect)
 {
@@ -16,19 +41,107 @@ void drawRectangle(cv::Mat img, cv::Rect faceRect)
     cv::rectangle(img, tl, br, cv::Scalar(0,255,0));
 }
 
-void perf(cv::VideoCapture cam, cv::CascadeClassifier detector, int gui)
+// Run detection on the frame with the current parameters, and let the
+// adaptive controller (if any) retune them from the time it took.
+int detectFrame(cv::CascadeClassifier &detector, ParallelDetector *pd, const cv::Mat &camImg,
+                std::vector<cv::Rect> &objects, detect_params *dp, adaptive_ctl *ctl)
+{
+    int ms;
+
+    tick();
+    if (pd)
+        pd->detect(camImg, objects, dp);
+    else
+        detectFaces(detector, camImg, objects, dp);
+    ms = tock();
+    if (ctl) {
+        adaptiveUpdate(ctl, ms, camImg.size(), dp);
+        printf("[Adaptive: avg %.1f ms, downscale %.2f, scaleFactor %.2f, minSize %dx%d]\n",
+               ctl->avgMs, dp->downscale, dp->scaleFactor, dp->minSize.width, dp->minSize.height);
+    }
+    return ms;
+}
+
+bool rectLess(const cv::Rect &a, const cv::Rect &b)
+{
+    if (a.y != b.y) return a.y < b.y;
+    if (a.x != b.x) return a.x < b.x;
+    return a.width < b.width;
+}
+
+bool sameDetections(std::vector<cv::Rect> a, std::vector<cv::Rect> b)
+{
+    if (a.size() != b.size())
+        return false;
+    std::sort(a.begin(), a.end(), rectLess);
+    std::sort(b.begin(), b.end(), rectLess);
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!(a[i] == b[i]))
+            return false;
+    }
+    return true;
+}
+
+// Time tile-parallel detection on the given frames for 1, 2, 4 ... maxThreads
+// workers, and report the speedup over single-threaded detectMultiScale.
+void perfParallel(std::vector<cv::Mat> &frames, cv::CascadeClassifier &detector,
+                  const char *haarfile, int maxThreads)
 {
+    std::vector<std::vector<cv::Rect> > expected(frames.size());
+    detect_params dp;
+    int serial_ms = 0;
+    size_t i;
+
+    defaultDetectParams(&dp);
+    for (i = 0; i < frames.size(); i++) {
+        tick();
+        detectFaces(detector, frames[i], expected[i], &dp);
+        serial_ms += tock();
+    }
+    printf("Serial detection: %d ms/frame\n", serial_ms / (int)frames.size());
+
+    for (int n = 1; ; n = std::min(n * 2, maxThreads)) {
+        WorkPool pool(n);
+        ParallelDetector pd(haarfile, &pool);
+        std::vector<cv::Rect> objects;
+        int parallel_ms = 0, matched = 0;
+
+        for (i = 0; i < frames.size(); i++) {
+            tick();
+            pd.detect(frames[i], objects, &dp);
+            parallel_ms += tock();
+            if (sameDetections(objects, expected[i]))
+                matched++;
+        }
+        printf("%2d threads: %d ms/frame, speedup %.2fx, %d/%zu frames match serial\n",
+               n, parallel_ms / (int)frames.size(),
+               parallel_ms ? (double)serial_ms / parallel_ms : 0.0, matched, frames.size());
+        if (n == maxThreads)
+            break;
+    }
+}
+
+void perf(cv::VideoCapture &cam, cv::CascadeClassifier detector, session_opts *so,
+          detect_params *dp, adaptive_ctl *ctl, ParallelDetector *pd,
+          const char *haarfile, int maxThreads)
+{
+    std::vector<cv::Mat> frames;
     cv::Mat camImg;
     cv::Mat shownImg;
     std::vector<cv::Rect> objects;
 
     int scale_ms = 0;
     int noscale_ms = 0;
-    if (gui)
+    int nframes = 0;
+    if (so->gui)
         cv::namedWindow("Input", CV_WINDOW_AUTOSIZE);
     for (int i = 0; i < 20; i++) {
         int ms;
-        cam >> camImg;
+        if (!cam.read(camImg) || camImg.empty())
+            break;
+        nframes++;
+        if (so->recorder)
+            so->recorder->write(camImg);
 #if 0
         tick();
         detector.detectMultiScale(camImg, objects, 1.2f, 2, 0, cv::Size(20, 20));
@@ -38,12 +151,14 @@ void perf(cv::VideoCapture cam, cv::CascadeClassifier detector, int gui)
         noscale_ms += ms;
 #endif
 
-        tick();
-        detector.detectMultiScale(camImg, objects, 1.2f, 2, detector.SCALE_IMAGE, cv::Size(20, 20));
-        ms = tock();
+        ms = detectFrame(detector, pd, camImg, objects, dp, ctl);
         printf("[Face Detection took %d ms and found %zu objects]\n",
                ms, objects.size());
-        if (gui) {
+        if (so->dump)
+            fprintf(so->dump, "%d,%d,%zu\n", i, ms, objects.size());
+        if (maxThreads > 0)
+            frames.push_back(camImg.clone());
+        if (so->gui) {
             shownImg = camImg.clone();
             for (std::vector<cv::Rect>::iterator i=objects.begin(); i != objects.end(); i++) {
                 drawRectangle(shownImg, *i);
@@ -54,29 +169,87 @@ void perf(cv::VideoCapture cam, cv::CascadeClassifier detector, int gui)
         scale_ms += ms;
 
     }
-    printf("Average time (scale, noscale): (%d ms, %d ms)\n", scale_ms/20, noscale_ms/20);
+    if (nframes == 0)
+        return;
+    printf("Average time (scale, noscale): (%d ms, %d ms)\n", scale_ms/nframes, noscale_ms/nframes);
+    if (maxThreads > 0 && !frames.empty())
+        perfParallel(frames, detector, haarfile, maxThreads);
+}
+
+// Step on to the next watchlist, with everyone after the last one.
+static void next_watchlist(Trainer &trainer)
+{
+    watchlist *wl = trainer.activeWatchlist();
+    size_t i = 0;
+
+    if (trainer.watchlists.empty())
+        return;
+    if (wl) {
+        while (trainer.watchlists[i] != wl)
+            i++;
+        i++;
+    }
+    if (i < trainer.watchlists.size()) {
+        trainer.useWatchlist(trainer.watchlists[i]->name.c_str());
+        printf("Watching %s\n", trainer.watchlists[i]->name.c_str());
+    } else {
+        trainer.useWatchlist(NULL);
+        printf("Watching everyone\n");
+    }
+}
+
+// Report how long it took from startup to the first fully processed frame.
+static void first_frame_done(session_opts *so)
+{
+    if (!so->startTicks)
+        return;
+    printf("Time to first frame: %.0f ms\n",
+           (cv::getTickCount() - so->startTicks) * 1000 / cv::getTickFrequency());
+    so->startTicks = 0;
+}
+
+// Runs on the enrollment writer thread.
+static void enrolled_cb(int status, const char *name, const char *filename, void *data)
+{
+    if (status == 0)
+        printf("Enrolled %s as %s\n", name, filename);
+    else
+        printf("Failed to enroll a face for %s\n", name);
 }
 
-void recognizeFromCam(cv::VideoCapture cam, cv::CascadeClassifier detector, Trainer &trainer)
+void recognizeFromCam(cv::VideoCapture &cam, cv::CascadeClassifier detector, Trainer &trainer,
+                      detect_params *dp, adaptive_ctl *ctl, ParallelDetector *pd, session_opts *so)
 {
     cv::Mat camImg;
     cv::Mat faceImg;
     cv::Mat shownImg;
     rec_result result;
+    std::vector<rec_candidate> candidates;
     cv::Rect faceRect;
     std::vector<cv::Rect> objects;
+    int nframes = 0, detect_ms = 0, recognize_ms = 0;
+    int64_t start = cv::getTickCount();
+    int64_t lastEnroll = 0;
 
     // Create a GUI window for the user to see the camera image.
-    cv::namedWindow("Input", CV_WINDOW_AUTOSIZE);
+    if (so->gui)
+        cv::namedWindow("Input", CV_WINDOW_AUTOSIZE);
     while (1) {
         // Get the camera frame
-        cam >> camImg;
-        shownImg = camImg.clone();
+        if (!cam.read(camImg) || camImg.empty())
+            break;
+        if (so->recorder)
+            so->recorder->write(camImg);
+        if (so->gui)
+            shownImg = camImg.clone();
 
-        tick();
-        detector.detectMultiScale(camImg, objects, 1.2f, 2, detector.SCALE_IMAGE, cv::Size(20, 20));
+        int ms = detectFrame(detector, pd, camImg, objects, dp, ctl);
         printf("[Face Detection took %d ms and found %zu objects]\n",
-                tock(), objects.size());
+                ms, objects.size());
+        detect_ms += ms;
+        if (so->dump)
+            fprintf(so->dump, "%d,%d,%zu", nframes, ms, objects.size());
+        nframes++;
         if (objects.size()) {
             char *name;
             faceRect = objects[0];
@@ -84,12 +257,44 @@ void recognizeFromCam(cv::VideoCapture cam, cv::CascadeClassifier detector, Trai
             // Crop out the face image ROI
             faceImg = cv::Mat(camImg, faceRect);
 
-            result = recognizeFromImage(faceImg, &trainer);
-            name = trainer.get_name(result.nearest);
+            // Only queued here; the writer thread does the disk and db work.
+            int64_t now = cv::getTickCount();
+            if (so->enroller && (now - lastEnroll) * 1000 / cv::getTickFrequency() >= ENROLL_INTERVAL_MS) {
+                if (so->enroller->enroll(so->enrollName, camImg, faceRect, enrolled_cb, NULL) == 0)
+                    lastEnroll = now;
+            }
+
+            if (so->shards)
+                result = so->shards->recognize(faceImg, so->topk, TOPK_PERSONS, candidates);
+            else
+                result = recognizeTopK(faceImg, &trainer, so->topk, TOPK_PERSONS, candidates);
+            // Nobody to match against (an empty watchlist), or a person
+            // without a name any more.
+            if (result.nearest < 0 || !(name = trainer.get_name(result.nearest)))
+                name = strdup("unknown");
             // Show the data on the screen.
-            printf("[Face Recognition took %d ms]\n", result.recognizeTime);
+            printf("[Face Recognition took %d ms, skipped %.0f%% of the search]\n",
+                   result.recognizeTime, result.skipped * 100);
             printf("Most likely person in camera: '%s' (confidence=%f.\n",
                    name, result.confidence);
+            for (size_t i = 0; so->topk > 1 && i < candidates.size(); i++) {
+                char *alt = trainer.get_name(candidates[i].person);
+                printf("  %zu. '%s' distance %.1f confidence %f\n",
+                       i + 1, alt ? alt : "unknown", candidates[i].distance, candidates[i].confidence);
+                free(alt);
+            }
+            first_frame_done(so);
+            recognize_ms += result.recognizeTime;
+            if (so->dump)
+                fprintf(so->dump, ",%d,%d,%d,%d,%d,%f,%d",
+                        faceRect.x, faceRect.y, faceRect.width, faceRect.height,
+                        result.nearest, result.confidence, result.recognizeTime);
+            if (!so->gui) {
+                free(name);
+                if (so->dump)
+                    fputc('\n', so->dump);
+                continue;
+            }
 
             // Show the detected face region.
             drawRectangle(shownImg, faceRect);
@@ -104,15 +309,165 @@ void recognizeFromCam(cv::VideoCapture cam, cv::CascadeClassifier detector, Trai
             free(name);
         } else {
             printf("No face found\n");
+            first_frame_done(so);
         }
+        if (so->dump)
+            fputc('\n', so->dump);
+        if (!so->gui)
+            continue;
 
         // Display the image.
         cv::imshow("Input", shownImg);
         // Give some time for OpenCV to draw the GUI and check if the user has pressed something in the GUI window.
-        if(cvWaitKey(10) != -1) {
+        // 'w' switches watchlist, anything else stops.
+        int key = cvWaitKey(10);
+        if (key == 'w') {
+            next_watchlist(trainer);
+        } else if (key != -1) {
             break;	// Stop processing input.
         }
     }
+
+    double secs = (cv::getTickCount() - start) / cv::getTickFrequency();
+    if (nframes)
+        printf("%d frames in %.2f s (%.1f fps), detection %.1f ms/frame, recognition %d ms total\n",
+               nframes, secs, nframes / secs, (double)detect_ms / nframes, recognize_ms);
+}
+
+// What the camera modes need before the first frame.  None of it depends on
+// the rest, so cold_start() loads it all at once, a thread per resource.
+typedef struct {
+    const char *camsrc, *haarfile, *trainfile;
+    int threads;
+    bool needModel;
+    Trainer *trainer;
+    cv::VideoCapture *cap;
+    cv::CascadeClassifier cascade;
+    WorkPool *pool;
+    ParallelDetector *pd;
+    ShardedGallery *shards;     // forked from a model loaded before cold_start(), if set
+} startup_ctx;
+
+typedef int(*startup_fn)(startup_ctx *sc);
+
+typedef struct {
+    const char *what;
+    startup_fn fn;
+    startup_ctx *sc;
+    int status, ms;
+    pthread_t thread;
+} startup_task;
+
+static int start_camera(startup_ctx *sc)
+{
+    if (!(sc->cap = openVideoSource(sc->camsrc))) {
+        printf("Failed to open video source %s\n", sc->camsrc);
+        return -1;
+    }
+    return 0;
+}
+
+static int start_cascade(startup_ctx *sc)
+{
+    if (!sc->cascade.load(sc->haarfile)) {
+        printf("Failed to load cascade file\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int start_detector(startup_ctx *sc)
+{
+    if (sc->threads <= 0)
+        return 0;
+    sc->pool = new WorkPool(sc->threads);
+    sc->pd = new ParallelDetector(sc->haarfile, sc->pool);
+    if (sc->pd->empty()) {
+        printf("Failed to load cascade file\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The model, the names it maps to, and its pages, so the first query runs
+// from memory.
+static int start_model(startup_ctx *sc)
+{
+    if (!sc->needModel || sc->shards)
+        return 0;
+    if (sc->trainer->loadTrainingData(sc->trainfile))
+        return -1;
+    sc->trainer->cacheNames();
+    sc->trainer->prefault();
+    return 0;
+}
+
+static void *startup_main(void *arg)
+{
+    startup_task *task = (startup_task *)arg;
+
+    tick();
+    task->status = task->fn(task->sc);
+    task->ms = tock();
+    return NULL;
+}
+
+int cold_start(startup_ctx *sc)
+{
+    startup_task tasks[] = {
+        {"camera", start_camera},
+        {"cascade", start_cascade},
+        {"detector", start_detector},
+        {"model", start_model},
+    };
+    const int ntasks = sizeof(tasks) / sizeof(tasks[0]);
+    int64_t start = cv::getTickCount();
+    int i, failed = 0;
+
+    sc->cap = NULL;
+    sc->pool = NULL;
+    sc->pd = NULL;
+    for (i = 0; i < ntasks; i++) {
+        tasks[i].sc = sc;
+        if (pthread_create(&tasks[i].thread, NULL, startup_main, &tasks[i])) {
+            fprintf(stderr, "Failed to start loader thread\n");
+            exit(1);
+        }
+    }
+    printf("Startup:");
+    for (i = 0; i < ntasks; i++) {
+        pthread_join(tasks[i].thread, NULL);
+        failed |= tasks[i].status;
+        printf(" %s %d ms,", tasks[i].what, tasks[i].ms);
+    }
+    printf(" %.0f ms in all\n", (cv::getTickCount() - start) * 1000 / cv::getTickFrequency());
+    return failed ? -1 : 0;
+}
+
+// Push a dummy frame through detection and recognition, so the one-time costs
+// (buffer allocation, the pool's first wakeups, cold code) are paid before
+// the first real frame.
+void warm_up(startup_ctx *sc, detect_params *dp)
+{
+    int w = sc->cap->get(CV_CAP_PROP_FRAME_WIDTH);
+    int h = sc->cap->get(CV_CAP_PROP_FRAME_HEIGHT);
+    std::vector<cv::Rect> objects;
+    int64_t start = cv::getTickCount();
+
+    cv::Mat frame(h > 0 ? h : 480, w > 0 ? w : 640, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+    detectFrame(sc->cascade, sc->pd, frame, objects, dp, NULL);
+    if (sc->needModel) {
+        cv::Mat face(sc->trainer->faceSize, CV_8UC1);
+        cv::randu(face, cv::Scalar::all(0), cv::Scalar::all(256));
+        if (sc->shards) {
+            std::vector<rec_candidate> candidates;
+            sc->shards->recognize(face, 1, TOPK_PERSONS, candidates);
+        } else {
+            recognizeFromImage(face, sc->trainer);
+        }
+    }
+    printf("Warm-up took %.0f ms\n", (cv::getTickCount() - start) * 1000 / cv::getTickFrequency());
 }
 
 int verify_cb(int index, const char *filename, void *data)
@@ -127,8 +482,8 @@ int verify_cb(int index, const char *filename, void *data)
         return -1;
     }
     result = recognizeFromImage(img, trainer);
-    printf("Verifying %s: Expect %d, Got %d [%s]\n", filename, index, result.nearest,
-           (index == result.nearest) ? "Success" : "Failure");
+    printf("Verifying %s: Expect %d, Got %d [%s] (skipped %.0f%%)\n", filename, index, result.nearest,
+           (index == result.nearest) ? "Success" : "Failure", result.skipped * 100);
 
     cvReleaseImage(&img);
     return 0;
@@ -139,18 +494,296 @@ void verify_training_images(Trainer *trainer)
     trainer->get_pictures(*verify_cb, trainer);
 }
 
+// Decode the source once into a shared-memory frame ring, for any number of
+// --videosrc shm:name consumers.
+int publishFrames(cv::VideoCapture &cam, const char *shmname, session_opts *so)
+{
+    ShmRingProducer ring;
+    cv::Mat frame;
+    int n = 0;
+
+    while (cam.read(frame) && !frame.empty()) {
+        if (n == 0 && ring.create(shmname, SHM_SLOTS, frame))
+            return -1;
+        if (ring.publish(frame))
+            return -1;
+        if (so->recorder)
+            so->recorder->write(frame);
+        n++;
+    }
+    printf("Published %d frames\n", n);
+    return 0;
+}
+
+typedef int(*listed_cb)(const char *name, const char *filename, void *data);
+
+// Call cb for every "number,name,filename" line of a list in the faces.txt
+// format, such as a set of held-out images.
+int for_each_listed(const char *listfile, listed_cb cb, void *data)
+{
+    FILE *fp;
+    char linebuf[256];
+    int count = 0;
+
+    if (!(fp = fopen(listfile, "r"))) {
+        fprintf(stderr, "Can\'t open file %s\n", listfile);
+        return -1;
+    }
+    while (fgets(linebuf, sizeof(linebuf), fp)) {
+        char *name = linebuf, *filename;
+        strsep(&name, ",");
+        filename = name;
+        strsep(&filename, ",");
+        if (!name || !filename)
+            continue;
+        filename[strcspn(filename, "\r\n")] = '\0';
+        if (cb(name, filename, data)) {
+            fclose(fp);
+            return -1;
+        }
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+typedef struct {
+    Trainer *trainer;
+    int tested, correct;
+} evaluate_data;
+
+int evaluate_cb(const char *name, const char *filename, void *data)
+{
+    evaluate_data *ed = (evaluate_data *)data;
+    cv::Mat img = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+    rec_result result;
+    char *got;
+
+    if (!img.data) {
+        fprintf(stderr, "Unable to load image %s\n", filename);
+        return 0;
+    }
+    result = recognizeFromImage(img, ed->trainer);
+    got = ed->trainer->get_name(result.nearest);
+    ed->tested++;
+    if (got && strcmp(got, name) == 0)
+        ed->correct++;
+    free(got);
+    return 0;
+}
+
+// Recognize every image of a held-out list and return the share that came
+// back as the listed person, or -1 on error.
+double evaluate_list(Trainer *trainer, const char *listfile)
+{
+    evaluate_data ed;
+
+    ed.trainer = trainer;
+    ed.tested = ed.correct = 0;
+    if (for_each_listed(listfile, evaluate_cb, &ed) < 0 || ed.tested == 0)
+        return -1;
+    printf("Recognized %d of %d held-out images (%.1f%%)\n",
+           ed.correct, ed.tested, 100.0 * ed.correct / ed.tested);
+    return (double)ed.correct / ed.tested;
+}
+
+// Condense the gallery, reporting the accuracy change on the held-out list
+// if there is one.
+void condense_model(Trainer *trainer, float threshold, int cap, const char *holdout)
+{
+    int before = trainer->nFaces;
+    double accBefore = -1, accAfter = -1;
+
+    if (holdout)
+        accBefore = evaluate_list(trainer, holdout);
+    trainer->condense(threshold, cap);
+    printf("Gallery: %d -> %d faces, %zu -> %zu bytes of projections\n",
+           before, trainer->nFaces,
+           (size_t)before * trainer->nEigens * sizeof(float),
+           (size_t)trainer->nFaces * trainer->nEigens * sizeof(float));
+    if (holdout)
+        accAfter = evaluate_list(trainer, holdout);
+    if (accBefore >= 0 && accAfter >= 0)
+        printf("Held-out accuracy: %.1f%% -> %.1f%% (%+.1f points)\n",
+               accBefore * 100, accAfter * 100, (accAfter - accBefore) * 100);
+}
+
+typedef struct {
+    Trainer *trainer;
+    std::vector<double> gallery;    // current score
+    std::vector<double> impostor;   // uncalibrated impostor score
+} calibrate_data;
+
+int calibrate_cb(const char *name, const char *filename, void *data)
+{
+    calibrate_data *cd = (calibrate_data *)data;
+    Trainer *trainer = cd->trainer;
+    cv::Mat img = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+    rec_result result;
+
+    if (!img.data) {
+        fprintf(stderr, "Unable to load image %s\n", filename);
+        return 0;
+    }
+    trainer->confidenceMode = CONFIDENCE_GALLERY;
+    result = recognizeFromImage(img, trainer);
+    cd->gallery.push_back(result.confidence);
+    trainer->confidenceMode = CONFIDENCE_IMPOSTOR;
+    result = recognizeFromImage(img, trainer);
+    cd->impostor.push_back(result.confidence);
+    return 0;
+}
+
+// Fit the impostor score onto the gallery score over an evaluation list by
+// least squares, so thresholds picked for one carry over to the other.
+int calibrate_confidence(Trainer *trainer, const char *listfile)
+{
+    calibrate_data cd;
+    double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0, err = 0;
+    size_t i, n;
+
+    if (trainer->impostorDists.empty()) {
+        fprintf(stderr, "Model has no impostor statistics, need 2 or more people\n");
+        return -1;
+    }
+    cd.trainer = trainer;
+    trainer->confScale = 1.0f;
+    trainer->confOffset = 0.0f;
+    if (for_each_listed(listfile, calibrate_cb, &cd) < 0)
+        return -1;
+    n = cd.gallery.size();
+    if (n < 2) {
+        fprintf(stderr, "Need 2 or more images to calibrate\n");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        double x = cd.impostor[i], y = cd.gallery[i];
+        sx += x; sy += y;
+        sxx += x*x; syy += y*y; sxy += x*y;
+    }
+    double vx = sxx - sx*sx/n, vy = syy - sy*sy/n, cxy = sxy - sx*sy/n;
+    double scale = vx > 0 ? cxy / vx : 0;
+    double offset = (sy - scale * sx) / n;
+    for (i = 0; i < n; i++)
+        err += fabs(scale * cd.impostor[i] + offset - cd.gallery[i]);
+    trainer->confScale = scale;
+    trainer->confOffset = offset;
+    printf("Calibrated on %zu images: confidence = %.4f * impostor + %.4f\n", n, scale, offset);
+    printf("Correlation with gallery score %.3f, mean absolute difference %.4f\n",
+           (vx > 0 && vy > 0) ? cxy / sqrt(vx * vy) : 0.0, err / n);
+    return 0;
+}
+
+typedef struct {
+    Trainer *trainer;
+    std::vector<cv::Mat> queries;
+} shardbench_data;
+
+int shardbench_cb(const char *name, const char *filename, void *data)
+{
+    shardbench_data *sd = (shardbench_data *)data;
+    cv::Mat img = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+
+    if (!img.data) {
+        fprintf(stderr, "Unable to load image %s\n", filename);
+        return 0;
+    }
+    sd->queries.push_back(projectFace(img, sd->trainer));
+    return 0;
+}
+
+static bool same_candidates(const std::vector<rec_candidate> &a, const std::vector<rec_candidate> &b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].person != b[i].person || a[i].distSq != b[i].distSq)
+            return false;
+    }
+    return true;
+}
+
+// Time the top-k search of every image on a list in one process, then over
+// 1, 2, 4 ... maxShards gallery shards, checking the shards give the same
+// candidates.  The images are projected up front so only the search is timed.
+int shard_benchmark(Trainer *trainer, const char *listfile, int maxShards, int k)
+{
+    shardbench_data sd;
+    std::vector<std::vector<rec_candidate> > expected;
+    std::vector<rec_candidate> candidates;
+    std::vector<int> counts;
+    float skipped;
+    size_t i;
+
+    sd.trainer = trainer;
+    if (for_each_listed(listfile, shardbench_cb, &sd) < 0 || sd.queries.empty())
+        return -1;
+
+    int64_t start = cv::getTickCount();
+    expected.resize(sd.queries.size());
+    for (i = 0; i < sd.queries.size(); i++)
+        findTopK(sd.queries[i], k, TOPK_PERSONS, expected[i], &skipped, trainer);
+    double localSecs = (cv::getTickCount() - start) / cv::getTickFrequency();
+    printf("%zu queries, top %d of %d faces\n", sd.queries.size(), k, trainer->nFaces);
+    printf("%-8s %10s %12s %8s %10s\n", "shards", "queries/s", "ms/query", "speedup", "mismatches");
+    printf("%-8s %10.1f %12.3f %8s %10s\n", "local", sd.queries.size() / localSecs,
+           localSecs * 1000 / sd.queries.size(), "1.00", "-");
+
+    for (int n = 1; n < maxShards; n *= 2)
+        counts.push_back(n);
+    counts.push_back(maxShards);
+    for (size_t c = 0; c < counts.size(); c++) {
+        ShardedGallery shards(trainer);
+        int mismatches = 0;
+        if (shards.start(counts[c]))
+            return -1;
+        start = cv::getTickCount();
+        for (i = 0; i < sd.queries.size(); i++) {
+            if (shards.search(sd.queries[i], k, TOPK_PERSONS, candidates, NULL, &skipped) < 0)
+                return -1;
+            if (!same_candidates(candidates, expected[i]))
+                mismatches++;
+        }
+        double secs = (cv::getTickCount() - start) / cv::getTickFrequency();
+        printf("%-8d %10.1f %12.3f %8.2f %10d\n", counts[c], sd.queries.size() / secs,
+               secs * 1000 / sd.queries.size(), localSecs / secs, mismatches);
+    }
+    return 0;
+}
+
 void usage(const char *prog)
 {
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "Recognize mode\n");
-    fprintf(stderr, "%s [--trainfile file] [--haarfile file]\n", prog);
+    fprintf(stderr, "%s [--trainfile file] [--haarfile file] [--latency ms] [--threads n]\n", prog);
+    fprintf(stderr, "Camera modes (recognize, perf) take [--nogui] [--record file] [--dump file]\n");
+    fprintf(stderr, "--videosrc replay:file or replayfast:file plays back a --record file\n");
+    fprintf(stderr, "Share one decoded source with --videosrc shm:name consumers\n");
+    fprintf(stderr, "%s [--videosrc src] [--record file] --shm name publish\n", prog);
+    fprintf(stderr, "Any recognizing mode takes [--search full|pruned] [--confidence gallery|impostor]\n");
+    fprintf(stderr, "[--vote k] picks the majority of the k nearest faces, --topk k lists k people per face\n");
+    fprintf(stderr, "and [--watchlists file] [--watchlist name]; 'w' in the window switches list\n");
+    fprintf(stderr, "Recognize mode also takes [--enroll name] to add the faces it sees to the database\n");
+    fprintf(stderr, "Recognize mode can split the gallery over worker processes with [--shards n]\n");
+    fprintf(stderr, "%s [--trainfile file] [--picsfile evalfile] [--topk k] --shards n shardbench\n", prog);
+    fprintf(stderr, "Calibrate the impostor confidence against the gallery one\n");
+    fprintf(stderr, "%s [--trainfile file] [--picsfile evalfile] calibrate\n", prog);
+    fprintf(stderr, "Multi-stream mode\n");
+    fprintf(stderr, "%s [--trainfile file] [--threads n] [--duration s] --videosrc src [--videosrc src ...] multi\n", prog);
     fprintf(stderr, "Train mode\n");
     fprintf(stderr, "%s [--trainfile file] [--picsfile file] train\n", prog);
+    fprintf(stderr, "%s [--trainfile file] --packfile file train\n", prog);
+    fprintf(stderr, "Train mode also takes [--condense dist[,cap]] [--holdout listfile]\n");
+    fprintf(stderr, "%s [--trainfile file] --condense dist[,cap] [--holdout listfile] condense\n", prog);
+    fprintf(stderr, "Packed face store\n");
+    fprintf(stderr, "%s --packfile file pack\n", prog);
+    fprintf(stderr, "%s --packfile file [--picsfile file] unpack dir\n", prog);
     exit(0);
 }
 
 int main(int argc, char *argv[])
 {
+    int64_t startTicks = cv::getTickCount();
     int c;
     int option_index;
 
@@ -158,16 +791,55 @@ int main(int argc, char *argv[])
     const char *trainfile = "facedata.xml";
     const char *picsfile = "faces.txt";
     const char *camsrc = "0";
+    std::vector<const char *> sources;
     const char *dbname = "test.db";
+    const char *packfile = NULL;
+    int searchMode = SEARCH_FULL;
+    int confidenceMode = CONFIDENCE_GALLERY;
+    const char *holdout = NULL;
+    float condenseDist = -1;
+    int condenseCap = 0;
+    int gui = 1;
+    const char *recordfile = NULL;
+    const char *dumpfile = NULL;
+    const char *shmname = NULL;
+    const char *watchfile = NULL;
+    const char *watchname = NULL;
+    int topk = 1;
+    int voteK = 0;
+    const char *enrollName = NULL;
+    int nShards = 0;
+    int latency = 0;
+    int threads = 0;
+    int duration = 0;
 
     static struct option long_options[] = {
         {"haarfile", required_argument, NULL, 'h'},
         {"trainfile", required_argument, NULL, 't'},
         {"picsfile", required_argument, NULL, 'p'},
         {"videosrc", required_argument, NULL, 'v'},
+        {"latency", required_argument, NULL, 'l'},
+        {"threads", required_argument, NULL, 'j'},
+        {"duration", required_argument, NULL, 'd'},
+        {"packfile", required_argument, NULL, 'k'},
+        {"search", required_argument, NULL, 's'},
+        {"confidence", required_argument, NULL, 'c'},
+        {"condense", required_argument, NULL, 'n'},
+        {"holdout", required_argument, NULL, 'o'},
+        {"nogui", no_argument, NULL, 'g'},
+        {"record", required_argument, NULL, 'r'},
+        {"dump", required_argument, NULL, 'u'},
+        {"shm", required_argument, NULL, 'm'},
+        {"watchlists", required_argument, NULL, 'W'},
+        {"watchlist", required_argument, NULL, 'w'},
+        {"topk", required_argument, NULL, 'K'},
+        {"vote", required_argument, NULL, 'V'},
+        {"enroll", required_argument, NULL, 'E'},
+        {"shards", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
     };
     while (1) {
-        c = getopt_long(argc, argv, "h:t:p:v:", long_options, &option_index);
+        c = getopt_long(argc, argv, "h:t:p:v:l:j:d:k:s:c:n:o:gr:u:m:W:w:K:V:E:S:", long_options, &option_index);
         if (c == -1) break;
 
         switch (c) {
@@ -186,6 +858,91 @@ int main(int argc, char *argv[])
             case 'v':
                 printf("Videosrc = %s\n", optarg);
                 camsrc = optarg;
+                sources.push_back(optarg);
+                break;
+            case 'l':
+                printf("Latency target = %s ms\n", optarg);
+                latency = strtol(optarg, NULL, 10);
+                break;
+            case 'j':
+                printf("Detection threads = %s\n", optarg);
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                printf("Duration = %s s\n", optarg);
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                printf("Packfile = %s\n", optarg);
+                packfile = optarg;
+                break;
+            case 's':
+                printf("Search = %s\n", optarg);
+                if (strcmp(optarg, "full") == 0)
+                    searchMode = SEARCH_FULL;
+                else if (strcmp(optarg, "pruned") == 0)
+                    searchMode = SEARCH_PRUNED;
+                else
+                    usage(argv[0]);
+                break;
+            case 'c':
+                printf("Confidence = %s\n", optarg);
+                if (strcmp(optarg, "gallery") == 0)
+                    confidenceMode = CONFIDENCE_GALLERY;
+                else if (strcmp(optarg, "impostor") == 0)
+                    confidenceMode = CONFIDENCE_IMPOSTOR;
+                else
+                    usage(argv[0]);
+                break;
+            case 'n':
+                printf("Condense = %s\n", optarg);
+                if (sscanf(optarg, "%f,%d", &condenseDist, &condenseCap) < 1)
+                    usage(argv[0]);
+                break;
+            case 'o':
+                printf("Holdout = %s\n", optarg);
+                holdout = optarg;
+                break;
+            case 'g':
+                gui = 0;
+                break;
+            case 'r':
+                printf("Recording to %s\n", optarg);
+                recordfile = optarg;
+                break;
+            case 'u':
+                printf("Dumping results to %s\n", optarg);
+                dumpfile = optarg;
+                break;
+            case 'm':
+                printf("Shared frame ring = %s\n", optarg);
+                shmname = optarg;
+                break;
+            case 'W':
+                printf("Watchlists = %s\n", optarg);
+                watchfile = optarg;
+                break;
+            case 'w':
+                printf("Watchlist = %s\n", optarg);
+                watchname = optarg;
+                break;
+            case 'K':
+                printf("Top k = %s\n", optarg);
+                topk = strtol(optarg, NULL, 10);
+                if (topk < 1)
+                    usage(argv[0]);
+                break;
+            case 'V':
+                printf("Vote k = %s\n", optarg);
+                voteK = strtol(optarg, NULL, 10);
+                break;
+            case 'E':
+                printf("Enrolling faces as %s\n", optarg);
+                enrollName = optarg;
+                break;
+            case 'S':
+                printf("Gallery shards = %s\n", optarg);
+                nShards = strtol(optarg, NULL, 10);
                 break;
             case '?':
                 usage(argv[0]);
@@ -197,43 +954,173 @@ int main(int argc, char *argv[])
     }
 
     Trainer t(dbname);
+    t.setSearchMode(searchMode);
+    t.confidenceMode = confidenceMode;
+    t.voteK = voteK;
+    if (watchfile && t.loadWatchlists(watchfile) < 0)
+        exit(1);
+    if (watchname && t.useWatchlist(watchname))
+        exit(1);
 
     if (optind < argc && strcmp(argv[optind], "train") == 0) {
         printf("Training...\n");
-        if(t.loadDbFromList(picsfile) <= 0)
+        if (packfile)
+            t.setPackFile(packfile);
+        else if(t.loadDbFromList(picsfile) <= 0)
             exit(1);
         if(t.learn())
             exit(1);
+        if (condenseDist >= 0)
+            condense_model(&t, condenseDist, condenseCap, holdout);
         printf("Training complete.  Saving...\n");
         t.storeEigenfaceImages();
         t.storeTrainingData(trainfile);
+    } else if (optind < argc && strcmp(argv[optind], "pack") == 0) {
+        if (!packfile)
+            usage(argv[0]);
+        if (t.packFaces(packfile))
+            exit(1);
+    } else if (optind < argc && strcmp(argv[optind], "unpack") == 0) {
+        if (!packfile || optind + 1 >= argc)
+            usage(argv[0]);
+        if (t.unpackFaces(packfile, argv[optind + 1], picsfile))
+            exit(1);
+    } else if (optind < argc && strcmp(argv[optind], "condense") == 0) {
+        if (condenseDist < 0)
+            usage(argv[0]);
+        if (t.loadTrainingData(trainfile))
+            exit(1);
+        condense_model(&t, condenseDist, condenseCap, holdout);
+        t.storeTrainingData(trainfile);
+    } else if (optind < argc && strcmp(argv[optind], "calibrate") == 0) {
+        if (t.loadTrainingData(trainfile))
+            exit(1);
+        if (calibrate_confidence(&t, picsfile))
+            exit(1);
+        t.storeTrainingData(trainfile);
     } else if (optind < argc && strcmp(argv[optind], "verify") == 0) {
         if (t.loadTrainingData(trainfile))
             exit(1);
         verify_training_images(&t);
-    } else {
-        cv::VideoCapture c;
-        if (camsrc[0] >= '0' && camsrc[0] <= '1') {
-            int cam_num = strtol(camsrc, NULL, 10);
-            c.open(cam_num);
-        } else {
-            c.open(camsrc);
+    } else if (optind < argc && strcmp(argv[optind], "shardbench") == 0) {
+        if (nShards <= 0)
+            usage(argv[0]);
+        if (t.loadTrainingData(trainfile))
+            exit(1);
+        if (shard_benchmark(&t, picsfile, nShards, topk))
+            exit(1);
+    } else if (optind < argc && strcmp(argv[optind], "multi") == 0) {
+        if (t.loadTrainingData(trainfile))
+            exit(1);
+        if (sources.empty())
+            sources.push_back(camsrc);
+        WorkPool pool(threads);
+        StreamServer server(&t, haarfile, &pool);
+        for (size_t i = 0; i < sources.size(); i++) {
+            if (server.addSource(sources[i]))
+                exit(1);
         }
-        cv::CascadeClassifier d(haarfile);
-        if (!c.isOpened()) {
+        server.run(duration);
+    } else if (optind < argc && strcmp(argv[optind], "publish") == 0) {
+        cv::VideoCapture *cap = openVideoSource(camsrc);
+        session_opts so;
+        FrameRecorder recorder;
+        if (!shmname)
+            usage(argv[0]);
+        if (!cap) {
             printf("Failed to open video source %s\n", camsrc);
             exit(1);
         }
-        if (d.empty()) {
-            printf("Failed to load cascade file\n");
-            exit(1);
+        so.gui = 0;
+        so.recorder = NULL;
+        so.dump = NULL;
+        so.topk = topk;
+        so.enroller = NULL;
+        so.enrollName = NULL;
+        so.startTicks = 0;
+        so.shards = NULL;
+        if (recordfile) {
+            if (recorder.open(recordfile, 95))
+                exit(1);
+            so.recorder = &recorder;
         }
-        if (optind < argc && strcmp(argv[optind], "perf") == 0) {
-            perf(c, d, 1);
-        } else {
+        if (publishFrames(*cap, shmname, &so))
+            exit(1);
+        delete cap;
+    } else {
+        bool perfMode = optind < argc && strcmp(argv[optind], "perf") == 0;
+        startup_ctx sc;
+        sc.camsrc = camsrc;
+        sc.haarfile = haarfile;
+        sc.trainfile = trainfile;
+        sc.threads = threads;
+        sc.needModel = !perfMode;
+        sc.trainer = &t;
+        sc.shards = NULL;
+        if (nShards > 0 && !perfMode) {
+            // fork() only copies the calling thread, so the workers have to
+            // be started before cold_start() or anything else makes threads.
+            // That means loading the model on its own first.  The gallery is
+            // only mapped here; each worker copies out its own part of it,
+            // and this process keeps just enough to score matches.
+            t.setScoreOnly(true);
             if (t.loadTrainingData(trainfile))
                 exit(1);
-            recognizeFromCam(c, d, t);
+            t.cacheNames();
+            sc.shards = new ShardedGallery(&t);
+            if (sc.shards->start(nShards))
+                exit(1);
+            t.dropGallery();
+        }
+        if (cold_start(&sc))
+            exit(1);
+        cv::VideoCapture &c = *sc.cap;
+        detect_params dp;
+        adaptive_ctl ctl;
+        defaultDetectParams(&dp);
+        if (latency > 0)
+            adaptiveInit(&ctl, latency, &dp);
+        session_opts so;
+        FrameRecorder recorder;
+        so.gui = gui;
+        so.recorder = NULL;
+        so.dump = NULL;
+        so.topk = topk;
+        so.enroller = NULL;
+        so.enrollName = NULL;
+        so.startTicks = startTicks;
+        so.shards = sc.shards;
+        if (recordfile) {
+            if (recorder.open(recordfile, 95))
+                exit(1);
+            so.recorder = &recorder;
+        }
+        if (dumpfile && !(so.dump = fopen(dumpfile, "w"))) {
+            fprintf(stderr, "Can't open file %s\n", dumpfile);
+            exit(1);
+        }
+        if (perfMode) {
+            perf(c, sc.cascade, &so, &dp, latency > 0 ? &ctl : NULL, sc.pd, haarfile, threads);
+        } else {
+            if (enrollName) {
+                so.enroller = new Enroller(dbname, "data/enrolled");
+                so.enrollName = enrollName;
+                if (so.enroller->start())
+                    exit(1);
+            }
+            warm_up(&sc, &dp);
+            recognizeFromCam(c, sc.cascade, t, &dp, latency > 0 ? &ctl : NULL, sc.pd, &so);
+            delete so.shards;
+            if (so.enroller) {
+                so.enroller->flush();
+                so.enroller->report();
+                delete so.enroller;
+            }
         }
+        if (so.dump)
+            fclose(so.dump);
+        delete sc.pd;
+        delete sc.pool;
+        delete sc.cap;
     }
 }
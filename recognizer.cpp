@@ -1,21 +1,19 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <map>
 
 #include "timer.h"
 #include "recognizer.h"
 
-int findNearestNeighbor(cv::Mat projectedTestFace, float *pConfidence, Trainer *trainer);
-
-rec_result recognizeFromImage(cv::Mat camImg, Trainer *trainer)
+// Bring a face crop into the form the model was trained on and project it
+// onto the eigenfaces.
+cv::Mat projectFace(cv::Mat camImg, Trainer *trainer)
 {
-    cv::Mat projectedTestFace;
     cv::Mat greyImg;
     cv::Mat sizedImg;
     cv::Mat equalizedImg;
-    rec_result result;
-
-    tick();
 
     // Make sure the image is greyscale, since the Eigenfaces is only done on greyscale image.
     if (camImg.channels() > 1)
@@ -31,52 +29,389 @@ rec_result recognizeFromImage(cv::Mat camImg, Trainer *trainer)
 
     // project the test image onto the PCA subspace
     // XXX need to resize
-    projectedTestFace = trainer->pca->project(equalizedImg.reshape(0, 1));
+    return trainer->pca->project(equalizedImg.reshape(0, 1));
+}
+
+rec_result recognizeFromImage(cv::Mat camImg, Trainer *trainer)
+{
+    std::vector<rec_candidate> candidates;
+
+    return recognizeTopK(camImg, trainer, 1, TOPK_IMAGES, candidates);
+}
+
+// Recognize a face and also return the k best candidates for it, from the
+// same pass over the gallery.  The decision is the nearest candidate, or
+// the vote of the trainer->voteK nearest faces if that is set.  If there is
+// nothing to search, candidates is empty and result.nearest is -1.
+rec_result recognizeTopK(cv::Mat camImg, Trainer *trainer, int k, int distinct,
+                         std::vector<rec_candidate> &candidates)
+{
+    std::vector<rec_candidate> voters;
+    rec_result result;
+
+    tick();
+    cv::Mat projectedTestFace = projectFace(camImg, trainer);
 
     // Check which person it is most likely to be.
-    result.iNearest = findNearestNeighbor(projectedTestFace, &result.confidence, trainer);
-    result.nearest  = trainer->personNumTruthMat.at<uint16_t>(result.iNearest);
+    if (findTopK(projectedTestFace, k, distinct, candidates, &result.skipped, trainer,
+                 trainer->voteK > 1 ? &voters : NULL) < 0) {
+        result.iNearest = -1;
+        result.nearest = -1;
+        result.confidence = 0;
+    } else {
+        decideResult(&result, candidates, voters, trainer);
+    }
 
     result.recognizeTime = tock();
     return result;
 }
 
-// Find the most likely person based on a detection. Returns the index, and stores the confidence value into pConfidence.
-int findNearestNeighbor(cv::Mat projectedTestFace, float *pConfidence, Trainer *trainer)
+// Fill in the decision from a search's candidates: the vote of voters if
+// trainer->voteK is set, or else the nearest candidate.
+void decideResult(rec_result *result, const std::vector<rec_candidate> &candidates,
+                  const std::vector<rec_candidate> &voters, Trainer *trainer)
 {
-    //double leastDistSq = 1e12;
-    double leastDistSq = DBL_MAX;
+    if (trainer->voteK > 1 && !voters.empty()) {
+        const rec_candidate &c = voters[voteCandidates(voters)];
+        result->iNearest = c.iTrain;
+        result->nearest = c.person;
+        result->confidence = c.confidence;
+    } else if (!candidates.empty()) {
+        result->iNearest = candidates[0].iTrain;
+        result->nearest = candidates[0].person;
+        result->confidence = candidates[0].confidence;
+    } else {
+        result->iNearest = -1;
+        result->nearest = -1;
+        result->confidence = 0;
+    }
+}
+
+// k-NN majority rule: the person most of the candidates belong to, with a
+// tie going to the one whose nearest face comes first.  Returns the position
+// of that person's nearest face in candidates.
+int voteCandidates(const std::vector<rec_candidate> &candidates)
+{
+    std::map<int, int> votes;
+    int best = 0;
+    size_t i;
+
+    for (i = 0; i < candidates.size(); i++)
+        votes[candidates[i].person]++;
+    for (i = 1; i < candidates.size(); i++) {
+        if (votes[candidates[i].person] > votes[candidates[best].person])
+            best = i;
+    }
+    return best;
+}
+
+// The faces a search walks: the whole model, or the active watchlist.
+typedef struct {
+    int nFaces;
+    const cv::Mat *projected;
+    const cv::Mat *ordered;
+    const cv::Mat *mean, *m2;
+    const int *index;       // row in the full gallery of each face, NULL if it is the full gallery
+} search_gallery;
+
+static void activeGallery(Trainer *trainer, search_gallery *g)
+{
+    watchlist *wl = trainer->activeWatchlist();
+
+    if (wl) {
+        g->nFaces = wl->nFaces;
+        g->projected = &wl->projected;
+        g->ordered = &wl->ordered;
+        g->mean = &wl->mean;
+        g->m2 = &wl->m2;
+        g->index = (const int *)wl->index.data;
+    } else {
+        g->nFaces = trainer->nFaces;
+        g->projected = &trainer->projectedTrainFaceMat;
+        g->ordered = &trainer->orderedTrainFaceMat;
+        g->mean = &trainer->galleryMean;
+        g->m2 = &trainer->galleryM2;
+        g->index = NULL;
+    }
+}
+
+// Partial sums are checked against the best distance so far every
+// PRUNE_BLOCK dimensions.
+#define PRUNE_BLOCK 8
+
+static double fullDistSq(const float *facedata, const float *trainFaceData,
+                         const float *eigenvalues, int nEigens)
+{
+    double distSq = 0;
+    int i;
+
+    for(i=0; i<nEigens; i++)
+        distSq += distTerm(facedata[i] - trainFaceData[i], eigenvalues[i]);
+    return distSq;
+}
+
+// Sum of the squared distances from the test face to every training face,
+// from the gallery mean and spread: sum_i (q - t_i)^2 = n (q - mean)^2 + M2.
+static double galleryDistSq(const float *facedata, const search_gallery *g, Trainer *trainer)
+{
+    const double *mean = (const double *)g->mean->data;
+    const double *m2 = (const double *)g->m2->data;
+    const float *eigenvalues = (const float *)trainer->pca->eigenvalues.data;
     double totDistSq = 0;
-    int i, iTrain, iNearest = 0;
-    const float *facedata = (const float *)projectedTestFace.data;
+    int i;
 
-    for(iTrain=0; iTrain<trainer->nFaces; iTrain++) {
-        double distSq=0;
-        const float *trainFaceData = (const float *)trainer->projectedTrainFaceMat.row(iTrain).data;
-
-        for(i=0; i<trainer->nEigens; i++) {
-            float d_i = facedata[i] - trainFaceData[i];
-#define USE_MAHALANOBIS_DISTANCE
-#ifdef USE_MAHALANOBIS_DISTANCE
-            distSq += d_i*d_i / ((float *)trainer->pca->eigenvalues.data)[i];  // Mahalanobis distance (might give better results than Eucalidean distance)
-#else
-            distSq += d_i*d_i; // Euclidean distance.
-#endif
-        }
+    for(i=0; i<trainer->nEigens; i++) {
+        double d_i = facedata[i] - mean[i];
+        totDistSq += (g->nFaces * d_i*d_i + m2[i]) * distTerm(1, eigenvalues[i]);
+    }
+    return totDistSq;
+}
 
-        totDistSq += distSq;
-        if(distSq < leastDistSq) {
-            leastDistSq = distSq;
-            iNearest = iTrain;
-        }
+// Turn the nearest distance into a confidence.  totDistSq is the sum of the
+// distances to the whole gallery if the search happened to compute it, or < 0.
+static float confidenceFromDistSq(const float *facedata, double leastDistSq, double totDistSq,
+                                  const search_gallery *g, Trainer *trainer)
+{
+    const cv::Mat &impostors = trainer->impostorDists;
+
+    if (trainer->confidenceMode == CONFIDENCE_IMPOSTOR && !impostors.empty()) {
+        // The share of train-time nearest impostors that were further away
+        // than this match, mapped onto the gallery score's scale.
+        const float *begin = (const float *)impostors.data;
+        const float *end = begin + impostors.total();
+        float dist = sqrt(leastDistSq);
+        double further = (end - std::upper_bound(begin, end, dist)) / (double)impostors.total();
+        return trainer->confScale * further + trainer->confOffset;
     }
 
     // Return the confidence level based on the Euclidean distance,
     // so that similar images should give a confidence between 0.5 to 1.0,
     // and very different images should give a confidence between 0.0 to 0.5.
-    double avgDist = sqrt(totDistSq/(double)(trainer->nFaces));
-    *pConfidence = 1.0f - sqrt(leastDistSq)/avgDist;
+    if (totDistSq < 0)
+        totDistSq = galleryDistSq(facedata, g, trainer);
+    double avgDist = sqrt(totDistSq/(double)(g->nFaces));
+    return 1.0f - sqrt(leastDistSq)/avgDist;
+}
+
+// The k best faces, or the k best people at their nearest face, seen so far
+// by a scan.  Kept as a max-heap on distance so the worst one is on top.
+typedef struct {
+    double distSq;
+    int iTrain;     // row in the gallery being searched
+    int person;
+} heap_entry;
+
+typedef struct {
+    int k;
+    int distinct;
+    std::vector<heap_entry> entries;
+} candidate_heap;
+
+static bool entryLess(const heap_entry &a, const heap_entry &b)
+{
+    return a.distSq < b.distSq;
+}
+
+// The distance a face has to beat to get into the heap.
+static inline double heapBound(const candidate_heap *h)
+{
+    return (int)h->entries.size() < h->k ? DBL_MAX : h->entries.front().distSq;
+}
+
+static void heapOffer(candidate_heap *h, double distSq, int iTrain, int person)
+{
+    heap_entry e;
+
+    // A person already in the heap is nearer than the top, so nothing at
+    // or past the top can change it.
+    if (distSq >= heapBound(h))
+        return;
+    if (h->distinct == TOPK_PERSONS) {
+        for (size_t i = 0; i < h->entries.size(); i++) {
+            if (h->entries[i].person != person)
+                continue;
+            if (distSq < h->entries[i].distSq) {
+                h->entries[i].distSq = distSq;
+                h->entries[i].iTrain = iTrain;
+                std::make_heap(h->entries.begin(), h->entries.end(), entryLess);
+            }
+            return;
+        }
+    }
+    e.distSq = distSq;
+    e.iTrain = iTrain;
+    e.person = person;
+    if ((int)h->entries.size() == h->k) {
+        std::pop_heap(h->entries.begin(), h->entries.end(), entryLess);
+        h->entries.back() = e;
+    } else {
+        h->entries.push_back(e);
+    }
+    std::push_heap(h->entries.begin(), h->entries.end(), entryLess);
+}
+
+// A face only matters if it gets into one of the heaps.
+static inline double scanBound(candidate_heap *heaps, int nHeaps)
+{
+    double bound = 0;
+    for (int h = 0; h < nHeaps; h++)
+        bound = std::max(bound, heapBound(&heaps[h]));
+    return bound;
+}
+
+static inline int personOf(const search_gallery *g, int iTrain, Trainer *trainer)
+{
+    return trainer->personNumTruthMat.at<uint16_t>(g->index ? g->index[iTrain] : iTrain);
+}
+
+// Exact k nearest neighbours with early abandoning.  Dimensions are visited
+// in decreasing order of contribution, and a training face is dropped as soon
+// as its partial sum is past every heap's k-th best full distance.  Survivors
+// are re-summed in the original order, so the heaps end up bit-for-bit as
+// the full scan leaves them.
+static void prunedScan(const float *facedata, candidate_heap *heaps, int nHeaps, float *pSkipped,
+                       const search_gallery *g, Trainer *trainer)
+{
+    const int nEigens = trainer->nEigens;
+    const int *order = (const int *)trainer->searchOrder.data;
+    const float *eigenvalues = (const float *)trainer->pca->eigenvalues.data;
+    const float *orderedEigenvalues = (const float *)trainer->searchEigenvalues.data;
+    std::vector<float> query(nEigens);
+    double work = 0;
+    int i, h, iTrain;
+
+    for(i=0; i<nEigens; i++)
+        query[i] = facedata[order[i]];
+
+    for(iTrain=0; iTrain<g->nFaces; iTrain++) {
+        const float *trainFaceData = g->ordered->ptr<float>(iTrain);
+        // Only the summation order differs from the exact distance, so a
+        // tiny relative margin keeps rounding from abandoning a tie.
+        double bound = scanBound(heaps, nHeaps) * (1.0 + 1e-9);
+        double distSq = 0;
+
+        for(i=0; i<nEigens && distSq <= bound; ) {
+            int end = std::min(i + PRUNE_BLOCK, nEigens);
+            for(; i<end; i++)
+                distSq += distTerm(query[i] - trainFaceData[i], orderedEigenvalues[i]);
+        }
+        if (distSq > bound) {
+            work += i;
+            continue;
+        }
+
+        // The partial sum only decided the face is worth keeping; its exact
+        // distance comes from the re-sum, so count a survivor as one full
+        // distance and skipped stays in [0,1].
+        distSq = fullDistSq(facedata, g->projected->ptr<float>(iTrain),
+                            eigenvalues, nEigens);
+        work += nEigens;
+        for (h = 0; h < nHeaps; h++)
+            heapOffer(&heaps[h], distSq, iTrain, personOf(g, iTrain, trainer));
+    }
+
+    *pSkipped = 1.0f - work / ((double)g->nFaces * nEigens);
+}
+
+// Walk the active gallery once, filling every heap.  Returns the sum of the
+// distances to all of its faces if the walk computed it, or -1.
+static double scanGallery(const float *facedata, candidate_heap *heaps, int nHeaps, float *pSkipped,
+                          const search_gallery *g, Trainer *trainer)
+{
+    const float *eigenvalues = (const float *)trainer->pca->eigenvalues.data;
+    double totDistSq = 0;
+    int iTrain, h;
+
+    *pSkipped = 0;
+    if (trainer->searchMode == SEARCH_PRUNED) {
+        prunedScan(facedata, heaps, nHeaps, pSkipped, g, trainer);
+        return -1;
+    }
+    for(iTrain=0; iTrain<g->nFaces; iTrain++) {
+        const float *trainFaceData = g->projected->ptr<float>(iTrain);
+        double distSq = fullDistSq(facedata, trainFaceData, eigenvalues, trainer->nEigens);
+
+        totDistSq += distSq;
+        if (distSq < scanBound(heaps, nHeaps)) {
+            for (h = 0; h < nHeaps; h++)
+                heapOffer(&heaps[h], distSq, iTrain, personOf(g, iTrain, trainer));
+        }
+    }
+    return totDistSq;
+}
+
+// Empty the heap into candidates, nearest first.
+static void heapCandidates(candidate_heap *h, const float *facedata, double totDistSq,
+                           const search_gallery *g, Trainer *trainer,
+                           std::vector<rec_candidate> &candidates)
+{
+    std::sort_heap(h->entries.begin(), h->entries.end(), entryLess);
+    candidates.resize(h->entries.size());
+    for (size_t i = 0; i < h->entries.size(); i++) {
+        const heap_entry &e = h->entries[i];
+        rec_candidate &c = candidates[i];
+        c.iTrain = g->index ? g->index[e.iTrain] : e.iTrain;
+        c.person = e.person;
+        c.distance = sqrt(e.distSq);
+        c.distSq = e.distSq;
+        c.confidence = confidenceFromDistSq(facedata, e.distSq, totDistSq, g, trainer);
+    }
+}
+
+// Find the k training faces nearest a projected face, or with distinct set
+// to TOPK_PERSONS, the k nearest people at their nearest face.  Only the
+// active watchlist is searched if there is one; candidate indexes are into
+// the full gallery either way.  If voters is given, it gets the
+// trainer->voteK nearest faces from the same pass.  Returns the number of
+// candidates, which is less than k if the gallery is small, or -1 if there
+// are no faces to search at all (such as a watchlist of people without
+// training faces).
+int findTopK(cv::Mat projectedTestFace, int k, int distinct, std::vector<rec_candidate> &candidates,
+             float *pSkipped, Trainer *trainer, std::vector<rec_candidate> *voters)
+{
+    const float *facedata = (const float *)projectedTestFace.data;
+    candidate_heap heaps[2];
+    int nHeaps = 1;
+    search_gallery g;
+
+    activeGallery(trainer, &g);
+    candidates.clear();
+    if (voters)
+        voters->clear();
+    *pSkipped = 0;
+    if (g.nFaces == 0)
+        return -1;
+    if (k <= 0)
+        return 0;
+
+    heaps[0].k = k;
+    heaps[0].distinct = distinct;
+    heaps[0].entries.reserve(k);
+    if (voters) {
+        heaps[1].k = trainer->voteK;
+        heaps[1].distinct = TOPK_IMAGES;
+        heaps[1].entries.reserve(trainer->voteK);
+        nHeaps = 2;
+    }
+    double totDistSq = scanGallery(facedata, heaps, nHeaps, pSkipped, &g, trainer);
+    // The gallery confidence needs the distance to the whole gallery; work
+    // it out once rather than per candidate if the scan didn't.
+    if (totDistSq < 0)
+        totDistSq = galleryDistSq(facedata, &g, trainer);
+
+    heapCandidates(&heaps[0], facedata, totDistSq, &g, trainer, candidates);
+    if (voters)
+        heapCandidates(&heaps[1], facedata, totDistSq, &g, trainer, *voters);
+    return candidates.size();
+}
+
+// Confidence of a match at squared distance distSq from a projected face,
+// against the active gallery, for a match found somewhere other than
+// findTopK (such as a gallery shard).
+float candidateConfidence(cv::Mat projectedTestFace, double distSq, Trainer *trainer)
+{
+    search_gallery g;
 
-    // Return the found index.
-    return iNearest;
+    activeGallery(trainer, &g);
+    return confidenceFromDistSq((const float *)projectedTestFace.data, distSq, -1, &g, trainer);
 }
@@ -1,9 +1,39 @@
+#ifndef __recognizer_h__
+#define __recognizer_h__
+
 #include "trainer.h"
 
 typedef struct {
     float confidence;
     int iNearest, nearest;
     int recognizeTime;
+    float skipped;      // fraction of the distance terms the search didn't compute
 } rec_result;
 
+// One of the k best matches for a face.
+typedef struct {
+    int iTrain;         // row in the full gallery
+    int person;
+    float distance;
+    float confidence;
+    double distSq;      // the exact squared distance the search ranked by
+} rec_candidate;
+
+// What findTopK ranks.
+enum {
+    TOPK_IMAGES,        // the k nearest training faces
+    TOPK_PERSONS,       // the k nearest people, each by their nearest face
+};
+
+cv::Mat projectFace(cv::Mat camImg, Trainer *trainer);
 rec_result recognizeFromImage(cv::Mat camImg, Trainer *trainer);
+rec_result recognizeTopK(cv::Mat camImg, Trainer *trainer, int k, int distinct,
+                         std::vector<rec_candidate> &candidates);
+int findTopK(cv::Mat projectedTestFace, int k, int distinct, std::vector<rec_candidate> &candidates,
+             float *pSkipped, Trainer *trainer, std::vector<rec_candidate> *voters = NULL);
+int voteCandidates(const std::vector<rec_candidate> &candidates);
+void decideResult(rec_result *result, const std::vector<rec_candidate> &candidates,
+                  const std::vector<rec_candidate> &voters, Trainer *trainer);
+float candidateConfidence(cv::Mat projectedTestFace, double distSq, Trainer *trainer);
+
+#endif
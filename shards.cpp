@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+#include "timer.h"
+#include "shards.h"
+
+// A query: this header, then the projected face as nEigens floats.
+typedef struct {
+    int32_t k;
+    int32_t distinct;
+    int32_t voteK;
+    int32_t watchlist;  // index into the watchlists of the list to search, or -1
+} shard_request;
+
+// A reply: this header, then nCandidates and nVoters entries.
+typedef struct {
+    int32_t nCandidates;
+    int32_t nVoters;
+    float skipped;
+} shard_reply;
+
+typedef struct {
+    int32_t iTrain;     // row in the full gallery
+    int32_t person;
+    double distSq;
+} shard_entry;
+
+static int writeFull(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int readFull(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void toEntries(const std::vector<rec_candidate> &candidates, const std::vector<int> &rows,
+                      std::vector<shard_entry> &entries)
+{
+    for (size_t i = 0; i < candidates.size(); i++) {
+        shard_entry e;
+        e.iTrain = rows[candidates[i].iTrain];
+        e.person = candidates[i].person;
+        e.distSq = candidates[i].distSq;
+        entries.push_back(e);
+    }
+}
+
+ShardedGallery::ShardedGallery(Trainer *trainer) : trainer(trainer)
+{
+}
+
+ShardedGallery::~ShardedGallery()
+{
+    stop();
+}
+
+// Fork nShards workers from the loaded model, which must still hold the
+// whole gallery.  Only the calling thread carries over into a worker, so
+// call this before the process starts any other thread: one holding a lock
+// (malloc's, OpenCV's) at the fork would leave it held in the worker for
+// good.  A worker only ever runs serve().
+int ShardedGallery::start(int nShards)
+{
+    int i;
+
+    stop();
+    fflush(stdout);
+    for (i = 0; i < nShards; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            perror("socketpair");
+            stop();
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+            stop();
+            return -1;
+        }
+        if (pid == 0) {
+            std::vector<int> rows;
+            for (size_t j = 0; j < fds.size(); j++)
+                close(fds[j]);
+            close(sv[0]);
+            trainer->keepShard(i, nShards, rows);
+            serve(trainer, sv[1], rows);
+            _exit(0);
+        }
+        close(sv[1]);
+        pids.push_back(pid);
+        fds.push_back(sv[0]);
+    }
+    return 0;
+}
+
+// Closing a worker's socket tells it to exit.
+void ShardedGallery::stop(void)
+{
+    size_t i;
+
+    for (i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    for (i = 0; i < pids.size(); i++)
+        waitpid(pids[i], NULL, 0);
+    fds.clear();
+    pids.clear();
+}
+
+// A worker's loop: answer queries until the coordinator goes away.  The
+// distances are exact; scoring them is left to the coordinator.
+void ShardedGallery::serve(Trainer *trainer, int fd, const std::vector<int> &rows)
+{
+    std::vector<float> query(trainer->nEigens);
+    std::vector<rec_candidate> candidates, voters;
+    std::vector<shard_entry> entries;
+    shard_request req;
+    shard_reply reply;
+
+    while (readFull(fd, &req, sizeof(req)) == 0 &&
+           readFull(fd, &query[0], query.size() * sizeof(float)) == 0) {
+        cv::Mat projected(1, trainer->nEigens, CV_32FC1, &query[0]);
+
+        trainer->voteK = req.voteK;
+        // Workers have the same lists as the coordinator, built over their
+        // part of the gallery, so the index picks out the same list.
+        if (req.watchlist >= 0 && req.watchlist < (int)trainer->watchlists.size())
+            trainer->useWatchlist(trainer->watchlists[req.watchlist]->name.c_str());
+        else
+            trainer->useWatchlist(NULL);
+        voters.clear();
+        findTopK(projected, req.k, req.distinct, candidates, &reply.skipped, trainer,
+                 req.voteK > 1 ? &voters : NULL);
+        entries.clear();
+        toEntries(candidates, rows, entries);
+        toEntries(voters, rows, entries);
+        reply.nCandidates = candidates.size();
+        reply.nVoters = voters.size();
+        if (writeFull(fd, &reply, sizeof(reply)) ||
+            (!entries.empty() && writeFull(fd, &entries[0], entries.size() * sizeof(shard_entry))))
+            break;
+    }
+    close(fd);
+}
+
+static bool entryNearer(const shard_entry &a, const shard_entry &b)
+{
+    if (a.distSq != b.distSq)
+        return a.distSq < b.distSq;
+    return a.iTrain < b.iTrain;
+}
+
+// Every worker's k best include its part of the global k best, and a person
+// only lives on one worker, so the merged k best are exact for both images
+// and distinct people.
+static void mergeEntries(std::vector<shard_entry> &entries, int k, cv::Mat projected,
+                         Trainer *trainer, std::vector<rec_candidate> &out)
+{
+    std::sort(entries.begin(), entries.end(), entryNearer);
+    if ((int)entries.size() > k)
+        entries.resize(k);
+    out.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        out[i].iTrain = entries[i].iTrain;
+        out[i].person = entries[i].person;
+        out[i].distance = sqrt(entries[i].distSq);
+        out[i].distSq = entries[i].distSq;
+        out[i].confidence = candidateConfidence(projected, entries[i].distSq, trainer);
+    }
+}
+
+// Scatter the query to every worker, then gather and merge.  Same contract
+// as findTopK; pSkipped is the average share the shards skipped.
+int ShardedGallery::search(cv::Mat projectedTestFace, int k, int distinct, std::vector<rec_candidate> &candidates,
+                           std::vector<rec_candidate> *voters, float *pSkipped)
+{
+    std::vector<shard_entry> merged, mergedVoters, entries;
+    shard_request req;
+    double skipped = 0;
+    size_t i;
+
+    candidates.clear();
+    *pSkipped = 0;
+    if (fds.empty() || k <= 0)
+        return 0;
+    req.k = k;
+    req.distinct = distinct;
+    req.voteK = voters ? trainer->voteK : 0;
+    // Search the list the coordinator will score against.
+    watchlist *wl = trainer->activeWatchlist();
+    req.watchlist = -1;
+    for (i = 0; wl && i < trainer->watchlists.size(); i++) {
+        if (trainer->watchlists[i] == wl)
+            req.watchlist = i;
+    }
+    for (i = 0; i < fds.size(); i++) {
+        if (writeFull(fds[i], &req, sizeof(req)) ||
+            writeFull(fds[i], projectedTestFace.data, trainer->nEigens * sizeof(float))) {
+            fprintf(stderr, "Lost gallery shard %zu\n", i);
+            return -1;
+        }
+    }
+    for (i = 0; i < fds.size(); i++) {
+        shard_reply reply;
+        if (readFull(fds[i], &reply, sizeof(reply)) == 0) {
+            entries.resize(reply.nCandidates + reply.nVoters);
+            if (entries.empty() || readFull(fds[i], &entries[0], entries.size() * sizeof(shard_entry)) == 0) {
+                merged.insert(merged.end(), entries.begin(), entries.begin() + reply.nCandidates);
+                mergedVoters.insert(mergedVoters.end(), entries.begin() + reply.nCandidates, entries.end());
+                skipped += reply.skipped;
+                continue;
+            }
+        }
+        fprintf(stderr, "Lost gallery shard %zu\n", i);
+        return -1;
+    }
+
+    mergeEntries(merged, k, projectedTestFace, trainer, candidates);
+    if (voters)
+        mergeEntries(mergedVoters, trainer->voteK, projectedTestFace, trainer, *voters);
+    *pSkipped = skipped / fds.size();
+    return candidates.size();
+}
+
+// recognizeTopK() over the shards.
+rec_result ShardedGallery::recognize(cv::Mat camImg, int k, int distinct, std::vector<rec_candidate> &candidates)
+{
+    std::vector<rec_candidate> voters;
+    rec_result result;
+
+    tick();
+    cv::Mat projectedTestFace = projectFace(camImg, trainer);
+    search(projectedTestFace, k, distinct, candidates, trainer->voteK > 1 ? &voters : NULL, &result.skipped);
+    decideResult(&result, candidates, voters, trainer);
+    result.recognizeTime = tock();
+    return result;
+}
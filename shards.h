@@ -0,0 +1,32 @@
+#ifndef __shards_h__
+#define __shards_h__
+
+#include <sys/types.h>
+#include <vector>
+
+#include "recognizer.h"
+
+// The gallery split by person over worker processes forked from a loaded
+// model.  Each worker keeps only its people's projected faces; the
+// coordinator projects a query once, sends it to every worker over a unix
+// socket, and merges the candidates they send back.  Matches are scored
+// against the whole gallery, so results are the ones a single process gives.
+class ShardedGallery {
+    public:
+        ShardedGallery(Trainer *trainer);
+        ~ShardedGallery();
+        int start(int nShards);
+        void stop(void);
+        int search(cv::Mat projectedTestFace, int k, int distinct, std::vector<rec_candidate> &candidates,
+                   std::vector<rec_candidate> *voters, float *pSkipped);
+        rec_result recognize(cv::Mat camImg, int k, int distinct, std::vector<rec_candidate> &candidates);
+        int shards(void) { return fds.size(); }
+    private:
+        Trainer *trainer;
+        std::vector<pid_t> pids;
+        std::vector<int> fds;   // coordinator's end of each worker's socket
+
+        static void serve(Trainer *trainer, int fd, const std::vector<int> &rows);
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+#define SHMRING_MAGIC "FRMRING1"
+#define SHMRING_ALIGN 64
+// Give up on a producer that has published nothing for this long.
+#define SHMRING_TIMEOUT_US (5 * 1000 * 1000)
+#define SHMRING_POLL_US 500
+
+typedef struct {
+    uint64_t seq;       // 2n while frame n is complete, odd while being written
+    int64_t timestamp;  // producer's capture time, in microseconds
+} shm_slot_header;
+
+struct shm_ring_header {
+    char magic[8];
+    uint32_t slots;
+    int32_t width, height, type;
+    uint32_t frameBytes;
+    uint32_t slotBytes;         // slot header + frame, padded to SHMRING_ALIGN
+    uint32_t closed;            // set when the producer goes away
+    uint64_t head;              // newest complete frame, 0 before the first
+};
+
+static size_t headerBytes(void)
+{
+    return (sizeof(shm_ring_header) + SHMRING_ALIGN - 1) & ~(size_t)(SHMRING_ALIGN - 1);
+}
+
+static shm_slot_header *slotAt(const shm_ring_header *hdr, uint64_t seq)
+{
+    char *base = (char *)hdr + headerBytes();
+    return (shm_slot_header *)(base + (size_t)hdr->slotBytes * (seq % hdr->slots));
+}
+
+static unsigned char *slotData(shm_slot_header *slot)
+{
+    return (unsigned char *)slot + SHMRING_ALIGN;
+}
+
+static int64_t nowUs(void)
+{
+    return (int64_t)(cv::getTickCount() * 1000000.0 / cv::getTickFrequency());
+}
+
+ShmRingProducer::ShmRingProducer() : hdr(NULL), mapLen(0)
+{
+    name[0] = '\0';
+}
+
+ShmRingProducer::~ShmRingProducer()
+{
+    close();
+}
+
+// Create the ring, sized for frames like first.  All frames published to it
+// must have the same size and type.
+int ShmRingProducer::create(const char *shmname, int slots, const cv::Mat &first)
+{
+    size_t frameBytes = first.total() * first.elemSize();
+    size_t slotBytes = (SHMRING_ALIGN + frameBytes + SHMRING_ALIGN - 1) & ~(size_t)(SHMRING_ALIGN - 1);
+    int fd;
+
+    close();
+    snprintf(name, sizeof(name), "/%s", shmname);
+    mapLen = headerBytes() + slotBytes * slots;
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    if (ftruncate(fd, mapLen)) {
+        perror(name);
+        ::close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    void *map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        perror(name);
+        shm_unlink(name);
+        return -1;
+    }
+
+    hdr = (shm_ring_header *)map;
+    hdr->slots = slots;
+    hdr->width = first.cols;
+    hdr->height = first.rows;
+    hdr->type = first.type();
+    hdr->frameBytes = frameBytes;
+    hdr->slotBytes = slotBytes;
+    hdr->closed = 0;
+    hdr->head = 0;
+    // Consumers only trust the ring once the magic is there.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic));
+    printf("Created frame ring %s: %d slots of %dx%d\n", name, slots, first.cols, first.rows);
+    return 0;
+}
+
+int ShmRingProducer::publish(const cv::Mat &frame)
+{
+    if (!hdr)
+        return -1;
+    if (frame.cols != hdr->width || frame.rows != hdr->height || frame.type() != hdr->type) {
+        fprintf(stderr, "Frame is %dx%d, ring holds %dx%d\n",
+                frame.cols, frame.rows, hdr->width, hdr->height);
+        return -1;
+    }
+    uint64_t seq = hdr->head + 1;
+    shm_slot_header *slot = slotAt(hdr, seq);
+    unsigned char *data = slotData(slot);
+
+    __atomic_store_n(&slot->seq, 2 * seq - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->timestamp = nowUs();
+    if (frame.isContinuous()) {
+        memcpy(data, frame.data, hdr->frameBytes);
+    } else {
+        size_t rowBytes = frame.cols * frame.elemSize();
+        for (int y = 0; y < frame.rows; y++)
+            memcpy(data + y * rowBytes, frame.ptr(y), rowBytes);
+    }
+    __atomic_store_n(&slot->seq, 2 * seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->head, seq, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void ShmRingProducer::close(void)
+{
+    if (hdr) {
+        __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+        munmap(hdr, mapLen);
+        // Attached consumers keep their mapping, new ones can't attach.
+        shm_unlink(name);
+    }
+    hdr = NULL;
+}
+
+ShmCapture::ShmCapture() : frames(0), skipped(0), overwritten(0), maxLag(0),
+    hdr(NULL), mapLen(0), current(0)
+{
+}
+
+ShmCapture::~ShmCapture()
+{
+    release();
+}
+
+bool ShmCapture::openShm(const char *shmname)
+{
+    char path[256];
+    struct stat st;
+    int fd;
+
+    release();
+    snprintf(path, sizeof(path), "/%s", shmname);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) || st.st_size < (off_t)headerBytes()) {
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    mapLen = st.st_size;
+    hdr = (const shm_ring_header *)map;
+    if (memcmp(hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic)) ||
+        headerBytes() + (size_t)hdr->slotBytes * hdr->slots > mapLen) {
+        fprintf(stderr, "%s is not a frame ring\n", path);
+        release();
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // Start with whatever is newest, not with history.
+    current = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    if (current > 0)
+        current--;
+    frames = skipped = overwritten = maxLag = 0;
+    return true;
+}
+
+bool ShmCapture::isOpened() const
+{
+    return hdr != NULL;
+}
+
+void ShmCapture::release()
+{
+    if (hdr) {
+        printStats();
+        munmap((void *)hdr, mapLen);
+    }
+    hdr = NULL;
+}
+
+void ShmCapture::printStats(void)
+{
+    printf("Frame ring: %llu frames read, %llu skipped, %llu overwritten while in use, max lag %llu\n",
+           (unsigned long long)frames, (unsigned long long)skipped,
+           (unsigned long long)overwritten, (unsigned long long)maxLag);
+}
+
+// True if the frame last handed out is still intact.
+bool ShmCapture::checkCurrent(void)
+{
+    shm_slot_header *slot = slotAt(hdr, current);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == 2 * current;
+}
+
+// Move on to the newest frame, waiting for one if we are caught up.
+bool ShmCapture::grab()
+{
+    int64_t waited = 0;
+    uint64_t head;
+
+    if (!hdr)
+        return false;
+    if (frames > 0 && !checkCurrent())
+        overwritten++;
+
+    while (1) {
+        head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        if (head <= current) {
+            if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) || waited >= SHMRING_TIMEOUT_US)
+                return false;
+            usleep(SHMRING_POLL_US);
+            waited += SHMRING_POLL_US;
+            continue;
+        }
+        // Lapped already if the slot has moved on, look at head again.
+        if (__atomic_load_n(&slotAt(hdr, head)->seq, __ATOMIC_ACQUIRE) == 2 * head)
+            break;
+    }
+    if (head - current > maxLag)
+        maxLag = head - current;
+    skipped += head - current - 1;
+    current = head;
+    return true;
+}
+
+bool ShmCapture::retrieve(cv::Mat &image, int channel)
+{
+    if (!hdr || current == 0)
+        return false;
+    image = cv::Mat(hdr->height, hdr->width, hdr->type, slotData(slotAt(hdr, current)));
+    frames++;
+    return true;
+}
+
+bool ShmCapture::read(cv::Mat &image)
+{
+    if (!grab()) {
+        image.release();
+        return false;
+    }
+    return retrieve(image);
+}
+
+cv::VideoCapture& ShmCapture::operator >> (cv::Mat &image)
+{
+    read(image);
+    return *this;
+}
+
+double ShmCapture::get(int propId)
+{
+    if (propId == CV_CAP_PROP_FRAME_WIDTH)
+        return hdr ? hdr->width : 0;
+    if (propId == CV_CAP_PROP_FRAME_HEIGHT)
+        return hdr ? hdr->height : 0;
+    if (propId == CV_CAP_PROP_POS_FRAMES)
+        return frames;
+    return 0;
+}
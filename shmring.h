@@ -0,0 +1,56 @@
+#ifndef __shmring_h__
+#define __shmring_h__
+
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+
+// A ring of decoded frames in POSIX shared memory, written by one producer
+// and read by any number of consumer processes.  Every slot is guarded by a
+// sequence lock, so the producer never waits for anyone: a consumer that
+// falls behind skips ahead to the newest frame, and one that holds on to a
+// frame for too long finds out afterwards that it was overwritten.
+
+struct shm_ring_header;
+
+class ShmRingProducer {
+    public:
+        ShmRingProducer();
+        ~ShmRingProducer();
+        int create(const char *name, int slots, const cv::Mat &first);
+        int publish(const cv::Mat &frame);
+        void close(void);
+    private:
+        char name[256];
+        shm_ring_header *hdr;
+        size_t mapLen;
+};
+
+// Attaches to a ring as a VideoCapture.  Frames are handed out zero-copy:
+// the Mat points straight into the shared slot and stays valid until the
+// producer wraps around to it.
+class ShmCapture : public cv::VideoCapture {
+    public:
+        ShmCapture();
+        virtual ~ShmCapture();
+        bool openShm(const char *name);
+        virtual bool isOpened() const;
+        virtual void release();
+        virtual bool grab();
+        virtual bool retrieve(cv::Mat &image, int channel = 0);
+        virtual bool read(cv::Mat &image);
+        virtual cv::VideoCapture& operator >> (cv::Mat &image);
+        virtual double get(int propId);
+        void printStats(void);
+
+        uint64_t frames;        // frames handed out
+        uint64_t skipped;       // frames never seen because we were behind
+        uint64_t overwritten;   // frames rewritten while we still held them
+        uint64_t maxLag;        // most frames we were behind the producer
+    private:
+        const shm_ring_header *hdr;
+        size_t mapLen;
+        uint64_t current;       // sequence number of the frame last handed out
+        bool checkCurrent(void);
+};
+
+#endif
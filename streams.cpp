@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "videosrc.h"
+#include "streams.h"
+
+#define REPORT_INTERVAL 5
+// Frame rate to read a video file at when it doesn't say.
+#define DEFAULT_FILE_FPS 25
+
+typedef struct {
+    StreamServer *server;
+    video_stream *stream;
+    cv::Mat frame;
+    int64_t ticks;
+} stream_job;
+
+static double ticksToMs(int64_t ticks)
+{
+    return ticks * 1000.0 / cv::getTickFrequency();
+}
+
+StreamServer::StreamServer(Trainer *t, const char *haarfile, WorkPool *workpool) :
+    trainer(t), pool(workpool)
+{
+    cascades.resize(pool->size());
+    for (size_t i = 0; i < cascades.size(); i++)
+        cascades[i].load(haarfile);
+    defaultDetectParams(&dp);
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    inflight = 0;
+    stopping = false;
+    startTicks = cv::getTickCount();
+}
+
+StreamServer::~StreamServer()
+{
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+    pool->wait();
+    for (i = 0; i < streams.size(); i++) {
+        pthread_join(streams[i]->thread, NULL);
+        delete streams[i]->cap;
+        delete streams[i];
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+int StreamServer::addSource(const char *src)
+{
+    video_stream *s;
+
+    if (cascades[0].empty()) {
+        fprintf(stderr, "Failed to load cascade file\n");
+        return -1;
+    }
+    s = new video_stream();
+    s->src = src;
+    s->server = this;
+    s->cap = openVideoSource(src);
+    if (!s->cap) {
+        fprintf(stderr, "Failed to open video source %s\n", src);
+        delete s;
+        return -1;
+    }
+    s->hasFrame = s->busy = s->eof = false;
+    // A plain video file decodes as fast as we ask, which would make the
+    // rate and drop figures measure the decoder.  Read it at the rate it
+    // was recorded at instead, like a camera.  Cameras, network streams,
+    // shm: and replay: sources come in at their own pace, and replayfast:
+    // is unpaced on purpose.
+    s->frameUs = 0;
+    if (!(src[0] >= '0' && src[0] <= '9') && !strchr(src, ':')) {
+        double fps = s->cap->get(CV_CAP_PROP_FPS);
+        if (!(fps > 0 && fps <= 1000))
+            fps = DEFAULT_FILE_FPS;
+        s->frameUs = 1e6 / fps;
+    }
+    s->captured = s->processed = s->dropped = 0;
+    s->latencySumMs = s->latencyMaxMs = 0;
+    s->lastPerson = -1;
+    s->lastConfidence = 0;
+
+    pthread_mutex_lock(&lock);
+    streams.push_back(s);
+    pthread_mutex_unlock(&lock);
+    if (pthread_create(&s->thread, NULL, capture_main, s)) {
+        fprintf(stderr, "Failed to start capture thread for %s\n", src);
+        exit(1);
+    }
+    return 0;
+}
+
+// Decode frames as fast as the source delivers them, or a file at its own
+// frame rate, keeping only the newest.
+void *StreamServer::capture_main(void *arg)
+{
+    video_stream *s = (video_stream *)arg;
+    StreamServer *srv = s->server;
+    int64_t startTicks = cv::getTickCount();
+    int64_t count = 0;
+    cv::Mat frame;
+
+    while (1) {
+        // read() into a fresh Mat, the previous one may still be with a worker.
+        frame.release();
+        bool ok = s->cap->read(frame) && !frame.empty();
+        if (ok && s->frameUs > 0) {
+            int64_t wait = count++ * s->frameUs -
+                           (cv::getTickCount() - startTicks) * 1e6 / cv::getTickFrequency();
+            if (wait > 0)
+                usleep(wait);
+        }
+
+        pthread_mutex_lock(&srv->lock);
+        if (!ok || srv->stopping) {
+            s->eof = true;
+            pthread_cond_signal(&srv->cond);
+            pthread_mutex_unlock(&srv->lock);
+            break;
+        }
+        s->captured++;
+        if (s->hasFrame)
+            s->dropped++;
+        s->latest = frame;
+        s->latestTicks = cv::getTickCount();
+        s->hasFrame = true;
+        pthread_cond_signal(&srv->cond);
+        pthread_mutex_unlock(&srv->lock);
+    }
+    return NULL;
+}
+
+void StreamServer::process_job(void *arg, int worker)
+{
+    stream_job *job = (stream_job *)arg;
+    StreamServer *srv = job->server;
+    video_stream *s = job->stream;
+    std::vector<cv::Rect> objects;
+    rec_result result;
+    int i;
+
+    result.nearest = -1;
+    result.confidence = 0;
+    detectFaces(srv->cascades[worker], job->frame, objects, &srv->dp);
+    for (i = 0; i < (int)objects.size(); i++) {
+        cv::Mat faceImg(job->frame, objects[i]);
+        rec_result r = recognizeFromImage(faceImg, srv->trainer);
+        if (i == 0 || r.confidence > result.confidence)
+            result = r;
+    }
+    double latency = ticksToMs(cv::getTickCount() - job->ticks);
+
+    pthread_mutex_lock(&srv->lock);
+    s->busy = false;
+    s->processed++;
+    s->latencySumMs += latency;
+    if (latency > s->latencyMaxMs)
+        s->latencyMaxMs = latency;
+    if (objects.size()) {
+        s->lastPerson = result.nearest;
+        s->lastConfidence = result.confidence;
+    }
+    srv->inflight--;
+    pthread_cond_signal(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+    delete job;
+}
+
+// Dispatch frames until every source has ended, or for the given number of
+// seconds if that is > 0.  Returns the number of frames processed.
+int StreamServer::run(int seconds)
+{
+    size_t rr = 0, i;
+    int total = 0;
+    int64_t freq = (int64_t)cv::getTickFrequency();
+    int64_t lastReport;
+
+    startTicks = lastReport = cv::getTickCount();
+    pthread_mutex_lock(&lock);
+    while (1) {
+        size_t n = streams.size();
+        bool live = false;
+
+        // Hand out at most one frame per stream, and no more than the pool
+        // has workers, starting after whichever stream was served last.
+        while (inflight < pool->size()) {
+            video_stream *s = NULL;
+            for (i = 0; i < n; i++) {
+                video_stream *candidate = streams[(rr + i) % n];
+                if (!candidate->busy && candidate->hasFrame) {
+                    s = candidate;
+                    rr = (rr + i + 1) % n;
+                    break;
+                }
+            }
+            if (!s)
+                break;
+            stream_job *job = new stream_job;
+            job->server = this;
+            job->stream = s;
+            job->frame = s->latest;
+            job->ticks = s->latestTicks;
+            s->latest = cv::Mat();
+            s->hasFrame = false;
+            s->busy = true;
+            inflight++;
+            total++;
+            pool->submit(process_job, job);
+        }
+
+        for (i = 0; i < streams.size(); i++) {
+            if (!streams[i]->eof || streams[i]->hasFrame)
+                live = true;
+        }
+        int64_t now = cv::getTickCount();
+        if ((!live && inflight == 0) || (seconds > 0 && now - startTicks >= seconds * freq))
+            break;
+        if (now - lastReport >= REPORT_INTERVAL * freq) {
+            lastReport = now;
+            pthread_mutex_unlock(&lock);
+            report();
+            pthread_mutex_lock(&lock);
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&cond, &lock, &ts);
+    }
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+    pool->wait();
+    report();
+    return total;
+}
+
+void StreamServer::report(void)
+{
+    double elapsed;
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    elapsed = ticksToMs(cv::getTickCount() - startTicks) / 1000.0;
+    printf("[%.1f s, %zu streams, %d workers]\n", elapsed, streams.size(), pool->size());
+    printf("%-32s %8s %8s %8s %10s %10s %8s\n",
+           "source", "in fps", "out fps", "dropped", "avg ms", "max ms", "person");
+    for (i = 0; i < streams.size(); i++) {
+        video_stream *s = streams[i];
+        printf("%-32s %8.1f %8.1f %8d %10.1f %10.1f %8d\n", s->src,
+               elapsed > 0 ? s->captured / elapsed : 0.0,
+               elapsed > 0 ? s->processed / elapsed : 0.0,
+               s->dropped,
+               s->processed ? s->latencySumMs / s->processed : 0.0,
+               s->latencyMaxMs, s->lastPerson);
+    }
+    pthread_mutex_unlock(&lock);
+}
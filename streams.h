@@ -0,0 +1,61 @@
+#ifndef __streams_h__
+#define __streams_h__
+
+#include <pthread.h>
+#include <vector>
+
+#include "detect.h"
+#include "recognizer.h"
+#include "workpool.h"
+
+class StreamServer;
+
+// One video source in multi-stream mode.  Its capture thread only keeps the
+// newest frame; a frame that is replaced before a worker picks it up counts
+// as dropped.
+typedef struct {
+    const char *src;
+    cv::VideoCapture *cap;
+    pthread_t thread;
+    StreamServer *server;
+
+    cv::Mat latest;
+    int64_t latestTicks;
+    bool hasFrame;      // latest is waiting for a worker
+    bool busy;          // a frame from this stream is being processed
+    bool eof;
+    double frameUs;     // > 0: a video file, read at this many us a frame
+
+    int captured, processed, dropped;
+    double latencySumMs, latencyMaxMs;
+    int lastPerson;
+    float lastConfidence;
+} video_stream;
+
+// Runs many video sources against one model and one worker pool.  Streams
+// are served round-robin with at most one frame in flight each, so a slow
+// stream can hold one worker but never starve the others.
+class StreamServer {
+    public:
+        StreamServer(Trainer *trainer, const char *haarfile, WorkPool *pool);
+        ~StreamServer();
+        int addSource(const char *src);
+        int run(int seconds);
+        void report(void);
+    private:
+        Trainer *trainer;
+        WorkPool *pool;
+        std::vector<cv::CascadeClassifier> cascades;   // one per worker
+        std::vector<video_stream *> streams;
+        detect_params dp;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int inflight;
+        bool stopping;
+        int64_t startTicks;
+
+        static void *capture_main(void *arg);
+        static void process_job(void *arg, int worker);
+};
+
+#endif
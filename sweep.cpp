@@ -0,0 +1,313 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "detect.h"
+#include "workpool.h"
+
+// Sweeps Haar detection settings over a labeled image set and reports speed
+// against recall and precision for every combination, marking the settings
+// on the speed/recall Pareto frontier.
+//
+// The label file has one line per face, "image,x,y,width,height"; an image
+// without faces can be listed with just its path.
+
+// A detection counts as a hit if it overlaps a labeled face this much
+// (intersection over union).
+#define MATCH_IOU 0.5
+
+typedef struct {
+    std::string path;
+    cv::Mat grey;
+    cv::Mat equalized;
+    std::vector<cv::Rect> faces;
+} labeled_image;
+
+typedef struct {
+    int cascade;
+    int equalize;
+    detect_params dp;
+    double imagesPerSec;
+    double detectionsPerSec;
+    int truePositives, detections;
+    double recall, precision;
+    bool pareto;
+} sweep_point;
+
+typedef struct {
+    std::vector<labeled_image> images;
+    std::vector<std::vector<cv::CascadeClassifier> > cascades;  // [cascade][worker]
+    const sweep_point *point;
+    std::vector<int> hits, found;   // per image, for the current point
+} sweep_ctx;
+
+static sweep_ctx ctx;
+
+static std::vector<double> parse_list(const char *arg)
+{
+    std::vector<double> values;
+    char *copy = strdup(arg), *rest = copy, *tok;
+
+    while ((tok = strsep(&rest, ",")))
+        values.push_back(atof(tok));
+    free(copy);
+    return values;
+}
+
+static int load_labels(const char *filename)
+{
+    std::map<std::string, size_t> index;
+    FILE *fp;
+    char linebuf[1024];
+
+    if (!(fp = fopen(filename, "r"))) {
+        fprintf(stderr, "Can\'t open file %s\n", filename);
+        return -1;
+    }
+    while (fgets(linebuf, sizeof(linebuf), fp)) {
+        char path[1024];
+        cv::Rect r;
+        linebuf[strcspn(linebuf, "\r\n")] = '\0';
+        int n = sscanf(linebuf, "%1023[^,],%d,%d,%d,%d", path, &r.x, &r.y, &r.width, &r.height);
+        if (n < 1)
+            continue;
+        if (index.find(path) == index.end()) {
+            labeled_image img;
+            img.path = path;
+            index[path] = ctx.images.size();
+            ctx.images.push_back(img);
+        }
+        if (n == 5)
+            ctx.images[index[path]].faces.push_back(r);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void decode_job(void *arg, int worker)
+{
+    labeled_image *img = (labeled_image *)arg;
+    img->grey = cv::imread(img->path, CV_LOAD_IMAGE_GRAYSCALE);
+    if (img->grey.data)
+        cv::equalizeHist(img->grey, img->equalized);
+}
+
+static double iou(const cv::Rect &a, const cv::Rect &b)
+{
+    double inter = (a & b).area();
+    double uni = a.area() + b.area() - inter;
+    return uni > 0 ? inter / uni : 0;
+}
+
+static void detect_job(void *arg, int worker)
+{
+    size_t i = (labeled_image *)arg - &ctx.images[0];
+    labeled_image &img = ctx.images[i];
+    const sweep_point *p = ctx.point;
+    std::vector<cv::Rect> objects;
+    std::vector<bool> used;
+
+    detectFaces(ctx.cascades[p->cascade][worker], p->equalize ? img.equalized : img.grey,
+                objects, &p->dp);
+    // Greedily pair every labeled face with its best unused detection.
+    used.assign(objects.size(), false);
+    ctx.hits[i] = 0;
+    for (size_t f = 0; f < img.faces.size(); f++) {
+        int best = -1;
+        double bestIou = MATCH_IOU;
+        for (size_t d = 0; d < objects.size(); d++) {
+            double o = iou(img.faces[f], objects[d]);
+            if (!used[d] && o >= bestIou) {
+                best = d;
+                bestIou = o;
+            }
+        }
+        if (best >= 0) {
+            used[best] = true;
+            ctx.hits[i]++;
+        }
+    }
+    ctx.found[i] = objects.size();
+}
+
+static void run_point(WorkPool &pool, sweep_point *p)
+{
+    size_t i;
+    int labeled = 0;
+
+    ctx.point = p;
+    ctx.hits.assign(ctx.images.size(), 0);
+    ctx.found.assign(ctx.images.size(), 0);
+    int64_t start = cv::getTickCount();
+    for (i = 0; i < ctx.images.size(); i++)
+        pool.submit(detect_job, &ctx.images[i]);
+    pool.wait();
+    double secs = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    p->truePositives = p->detections = 0;
+    for (i = 0; i < ctx.images.size(); i++) {
+        p->truePositives += ctx.hits[i];
+        p->detections += ctx.found[i];
+        labeled += ctx.images[i].faces.size();
+    }
+    p->imagesPerSec = secs > 0 ? ctx.images.size() / secs : 0;
+    p->detectionsPerSec = secs > 0 ? p->detections / secs : 0;
+    p->recall = labeled ? (double)p->truePositives / labeled : 0;
+    p->precision = p->detections ? (double)p->truePositives / p->detections : 0;
+}
+
+static bool faster(const sweep_point &a, const sweep_point &b)
+{
+    return a.imagesPerSec > b.imagesPerSec;
+}
+
+// A point is on the frontier if nothing faster has at least its recall.
+static void mark_pareto(std::vector<sweep_point> &points)
+{
+    double bestRecall = -1;
+
+    std::sort(points.begin(), points.end(), faster);
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i].pareto = points[i].recall > bestRecall;
+        if (points[i].pareto)
+            bestRecall = points[i].recall;
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [--haarfile file ...] [--scale list] [--neighbors list] [--minsize list]\n"
+                    "    [--downscale list] [--equalize list] [--threads n] labelfile\n", prog);
+    fprintf(stderr, "Lists are comma separated, e.g. --scale 1.05,1.1,1.2\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int option_index;
+
+    std::vector<const char *> haarfiles;
+    std::vector<double> scales = parse_list("1.1,1.2");
+    std::vector<double> neighbors = parse_list("2,3");
+    std::vector<double> minsizes = parse_list("20,30");
+    std::vector<double> downscales = parse_list("1,2");
+    std::vector<double> equalize = parse_list("0,1");
+    int threads = 0;
+
+    static struct option long_options[] = {
+        {"haarfile", required_argument, NULL, 'h'},
+        {"scale", required_argument, NULL, 's'},
+        {"neighbors", required_argument, NULL, 'n'},
+        {"minsize", required_argument, NULL, 'm'},
+        {"downscale", required_argument, NULL, 'd'},
+        {"equalize", required_argument, NULL, 'e'},
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0},
+    };
+    while (1) {
+        c = getopt_long(argc, argv, "h:s:n:m:d:e:j:", long_options, &option_index);
+        if (c == -1) break;
+
+        switch (c) {
+            case 'h':
+                haarfiles.push_back(optarg);
+                break;
+            case 's':
+                scales = parse_list(optarg);
+                break;
+            case 'n':
+                neighbors = parse_list(optarg);
+                break;
+            case 'm':
+                minsizes = parse_list(optarg);
+                break;
+            case 'd':
+                downscales = parse_list(optarg);
+                break;
+            case 'e':
+                equalize = parse_list(optarg);
+                break;
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case '?':
+                usage(argv[0]);
+                break;
+            default:
+                abort();
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+    if (haarfiles.empty())
+        haarfiles.push_back("data/haarcascades/haarcascade_frontalface_alt.xml");
+
+    if (load_labels(argv[optind]))
+        exit(1);
+    WorkPool pool(threads);
+    for (size_t i = 0; i < ctx.images.size(); i++)
+        pool.submit(decode_job, &ctx.images[i]);
+    pool.wait();
+    for (size_t i = 0; i < ctx.images.size(); i++) {
+        if (!ctx.images[i].grey.data) {
+            fprintf(stderr, "Can\'t load image from '%s'\n", ctx.images[i].path.c_str());
+            exit(1);
+        }
+    }
+
+    ctx.cascades.resize(haarfiles.size());
+    for (size_t h = 0; h < haarfiles.size(); h++) {
+        ctx.cascades[h].resize(pool.size());
+        for (int w = 0; w < pool.size(); w++) {
+            if (!ctx.cascades[h][w].load(haarfiles[h])) {
+                fprintf(stderr, "ERROR: Could not load classifier cascade %s\n", haarfiles[h]);
+                exit(1);
+            }
+        }
+    }
+    printf("Sweeping %zu images on %d threads\n", ctx.images.size(), pool.size());
+
+    std::vector<sweep_point> points;
+    for (size_t h = 0; h < haarfiles.size(); h++)
+    for (size_t e = 0; e < equalize.size(); e++)
+    for (size_t d = 0; d < downscales.size(); d++)
+    for (size_t s = 0; s < scales.size(); s++)
+    for (size_t n = 0; n < neighbors.size(); n++)
+    for (size_t m = 0; m < minsizes.size(); m++) {
+        sweep_point p;
+        p.cascade = h;
+        p.equalize = equalize[e] != 0;
+        defaultDetectParams(&p.dp);
+        p.dp.downscale = downscales[d];
+        p.dp.scaleFactor = scales[s];
+        p.dp.minNeighbors = (int)neighbors[n];
+        p.dp.minSize = cv::Size((int)minsizes[m], (int)minsizes[m]);
+        run_point(pool, &p);
+        printf("cascade %zu eq %d down %.2f scale %.2f neighbors %d min %d: "
+               "%.1f img/s, %.1f det/s, recall %.3f, precision %.3f\n",
+               h, p.equalize, p.dp.downscale, p.dp.scaleFactor, p.dp.minNeighbors,
+               p.dp.minSize.width, p.imagesPerSec, p.detectionsPerSec, p.recall, p.precision);
+        points.push_back(p);
+    }
+
+    mark_pareto(points);
+    printf("\n%-3s %-40s %3s %6s %6s %4s %4s %10s %10s %8s %9s\n", "", "cascade", "eq", "down",
+           "scale", "nbrs", "min", "img/s", "det/s", "recall", "precision");
+    for (size_t i = 0; i < points.size(); i++) {
+        sweep_point &p = points[i];
+        printf("%-3s %-40s %3d %6.2f %6.2f %4d %4d %10.1f %10.1f %8.3f %9.3f\n",
+               p.pareto ? "*" : "", haarfiles[p.cascade], p.equalize, p.dp.downscale,
+               p.dp.scaleFactor, p.dp.minNeighbors, p.dp.minSize.width,
+               p.imagesPerSec, p.detectionsPerSec, p.recall, p.precision);
+    }
+    printf("* = on the speed/recall Pareto frontier\n");
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <opencv2/opencv.hpp>
 
-static double timecnt;
+// Per thread, so the worker pools can time their own work.
+static __thread double timecnt;
 
 void tick(void)
 {
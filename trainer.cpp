@@ -1,3 +1,14 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+
 #include "trainer.h"
 
 #define ERROR_CHECK(x, err) if (x != SQLITE_OK) { \
@@ -20,6 +31,18 @@
 Trainer::Trainer(const char  *dbfile) : dbname(dbfile)
 {
     pca = NULL;
+    searchMode = SEARCH_FULL;
+    confidenceMode = CONFIDENCE_GALLERY;
+    voteK = 0;
+    confScale = 1.0f;
+    confOffset = 0.0f;
+    packname = NULL;
+    packMap = NULL;
+    packMapLen = 0;
+    galleryMap = NULL;
+    galleryMapLen = 0;
+    scoreOnly = false;
+    activeList = NULL;
     int ret = opendb();
     if (ret != 0) {
         throw(ret);
@@ -33,6 +56,11 @@ Trainer::~Trainer()
         sqlite3_close(db);
     if (pca)
         delete pca;
+    unmapPack();
+    projectedTrainFaceMat.release();
+    unmapGallery();
+    for (size_t i = 0; i < watchlists.size(); i++)
+        delete watchlists[i];
 }
 
 // Train from the data in the given text file, and store the trained data into the file
@@ -41,10 +69,18 @@ int Trainer::learn(void)
     int i, ret;
 
     // load training data
-    ret = loadImagesFromDb();
-    if (ret) {
-        printf("Failed to load images from database\n");
-        return -1;
+    if (packname) {
+        ret = loadImagesFromPack(packname);
+        if (ret) {
+            printf("Failed to load images from %s\n", packname);
+            return -1;
+        }
+    } else {
+        ret = loadImagesFromDb();
+        if (ret) {
+            printf("Failed to load images from database\n");
+            return -1;
+        }
     }
     printf("Got %d training images.\n", nFaces);
     if(nFaces < 2) { fprintf(stderr,
@@ -57,12 +93,403 @@ int Trainer::learn(void)
     doPCA();
 
     // project the training images onto the PCA subspace
+    projectedTrainFaceMat.release();
+    unmapGallery();
     projectedTrainFaceMat.create(nFaces, nEigens, CV_32FC1);
     printf("Projecting %d training faces\n", nFaces);
     for(i=0; i<nFaces; i++) {
         cv::Mat row = projectedTrainFaceMat.row(i);
         pca->project(faceImages[i].reshape(0, 1)).copyTo(row);
     }
+    computeGalleryStats();
+    prepareSearch();
+    return 0;
+}
+
+void Trainer::setSearchMode(int mode)
+{
+    searchMode = mode;
+    if (pca)
+        prepareSearch();
+}
+
+static bool contributionGreater(const std::pair<double, int> &a, const std::pair<double, int> &b)
+{
+    return a.first > b.first;
+}
+
+// Most impostor probes to take from the gallery, to bound the O(n^2) scan.
+#define MAX_IMPOSTOR_PROBES 1000
+
+static double projectedDistSq(const float *a, const float *b, const float *eigenvalues, int n)
+{
+    double distSq = 0;
+    for (int i = 0; i < n; i++)
+        distSq += distTerm(a[i] - b[i], eigenvalues[i]);
+    return distSq;
+}
+
+// Per-dimension mean and sum of squared deviations over the rows of faces.
+static void galleryMoments(const cv::Mat &faces, cv::Mat &galleryMean, cv::Mat &galleryM2)
+{
+    int i, j;
+
+    galleryMean = cv::Mat::zeros(1, faces.cols, CV_64FC1);
+    galleryM2 = cv::Mat::zeros(1, faces.cols, CV_64FC1);
+    if (faces.rows == 0)
+        return;
+    double *mean = (double *)galleryMean.data;
+    double *m2 = (double *)galleryM2.data;
+    for (i = 0; i < faces.rows; i++) {
+        const float *row = faces.ptr<float>(i);
+        for (j = 0; j < faces.cols; j++)
+            mean[j] += row[j];
+    }
+    for (j = 0; j < faces.cols; j++)
+        mean[j] /= faces.rows;
+    for (i = 0; i < faces.rows; i++) {
+        const float *row = faces.ptr<float>(i);
+        for (j = 0; j < faces.cols; j++)
+            m2[j] += (row[j] - mean[j]) * (row[j] - mean[j]);
+    }
+}
+
+// Statistics the confidence scores need, so a query never has to visit the
+// whole gallery for them.  The per-dimension mean and spread give the average
+// distance from a query to the gallery in O(nEigens).  The nearest-impostor
+// distances (from a face to the closest face of anyone else) give a fixed
+// reference for how far apart different people usually are.
+void Trainer::computeGalleryStats(void)
+{
+    int i, j;
+
+    galleryMoments(projectedTrainFaceMat, galleryMean, galleryM2);
+
+    const float *eigenvalues = (const float *)pca->eigenvalues.data;
+    int step = (nFaces + MAX_IMPOSTOR_PROBES - 1) / MAX_IMPOSTOR_PROBES;
+    std::vector<float> dists;
+    for (i = 0; i < nFaces; i += step) {
+        int pid = personNumTruthMat.at<uint16_t>(i);
+        double least = DBL_MAX;
+        for (j = 0; j < nFaces; j++) {
+            if (personNumTruthMat.at<uint16_t>(j) == pid)
+                continue;
+            double distSq = projectedDistSq(projectedTrainFaceMat.ptr<float>(i),
+                                            projectedTrainFaceMat.ptr<float>(j),
+                                            eigenvalues, nEigens);
+            least = std::min(least, distSq);
+        }
+        if (least < DBL_MAX)
+            dists.push_back(sqrt(least));
+    }
+    std::sort(dists.begin(), dists.end());
+    if (dists.empty())
+        impostorDists.release();
+    else
+        impostorDists = cv::Mat(dists, true).reshape(0, 1);
+}
+
+// Replace each person's training faces with a few representatives.  A face
+// is kept only if it is more than threshold (in the search's distance units)
+// from every face kept so far for that person.  If more than cap remain,
+// the cap most spread out ones are taken by farthest-point selection.
+// threshold <= 0 or cap <= 0 turns that step off.  The eigenbasis is left
+// alone and any confidence calibration is dropped; returns the new number
+// of faces.
+int Trainer::condense(float threshold, int cap)
+{
+    const float *eigenvalues = (const float *)pca->eigenvalues.data;
+    double thresholdSq = (double)threshold * threshold;
+    std::map<int, std::vector<int> > people;
+    std::map<int, std::vector<int> >::iterator it;
+    std::vector<int> keep;
+    size_t i, j;
+
+    for (int f = 0; f < nFaces; f++)
+        people[personNumTruthMat.at<uint16_t>(f)].push_back(f);
+
+    for (it = people.begin(); it != people.end(); it++) {
+        std::vector<int> &faces = it->second;
+        std::vector<int> protos;
+
+        for (i = 0; i < faces.size(); i++) {
+            const float *face = projectedTrainFaceMat.ptr<float>(faces[i]);
+            bool distinct = true;
+            for (j = 0; j < protos.size() && threshold > 0; j++) {
+                if (projectedDistSq(face, projectedTrainFaceMat.ptr<float>(protos[j]),
+                                    eigenvalues, nEigens) <= thresholdSq) {
+                    distinct = false;
+                    break;
+                }
+            }
+            if (distinct)
+                protos.push_back(faces[i]);
+        }
+
+        if (cap > 0 && (int)protos.size() > cap) {
+            // nearest[k] is the distance from protos[k] to the chosen set.
+            std::vector<double> nearest(protos.size(), DBL_MAX);
+            std::vector<int> chosen;
+            size_t next = 0;
+            while ((int)chosen.size() < cap) {
+                const float *pick = projectedTrainFaceMat.ptr<float>(protos[next]);
+                chosen.push_back(protos[next]);
+                nearest[next] = -1;
+                next = 0;
+                for (j = 0; j < protos.size(); j++) {
+                    if (nearest[j] < 0)
+                        continue;
+                    nearest[j] = std::min(nearest[j],
+                            projectedDistSq(pick, projectedTrainFaceMat.ptr<float>(protos[j]),
+                                            eigenvalues, nEigens));
+                    if (nearest[next] < 0 || nearest[j] > nearest[next])
+                        next = j;
+                }
+            }
+            protos = chosen;
+        }
+        keep.insert(keep.end(), protos.begin(), protos.end());
+    }
+    std::sort(keep.begin(), keep.end());
+
+    cv::Mat projected(keep.size(), nEigens, CV_32FC1);
+    cv::Mat truth(1, keep.size(), CV_16UC1);
+    std::vector<cv::Mat> images;
+    for (i = 0; i < keep.size(); i++) {
+        cv::Mat row = projected.row(i);
+        projectedTrainFaceMat.row(keep[i]).copyTo(row);
+        truth.at<uint16_t>(i) = personNumTruthMat.at<uint16_t>(keep[i]);
+        if ((int)faceImages.size() == nFaces)
+            images.push_back(faceImages[keep[i]]);
+    }
+    printf("Condensed %d training faces of %zu people to %zu (%.1f%% of the gallery)\n",
+           nFaces, people.size(), keep.size(), 100.0 * keep.size() / nFaces);
+
+    projectedTrainFaceMat = projected;
+    personNumTruthMat = truth;
+    faceImages = images;
+    nFaces = keep.size();
+    computeGalleryStats();
+    prepareSearch();
+    // The impostor distances just changed, so an old calibration no longer
+    // maps them onto the gallery score.
+    if (confScale != 1.0f || confOffset != 0.0f) {
+        confScale = 1.0f;
+        confOffset = 0.0f;
+        printf("Confidence calibration reset, run calibrate again on the condensed model\n");
+    }
+    return nFaces;
+}
+
+// Keep only the faces of the people with id % nShards == shard, as one worker
+// of a sharded gallery does, and return the original row of each kept face
+// in rows.  The eigenbasis and the gallery statistics are left describing the
+// whole gallery: the search order stays the same on every shard, and only the
+// coordinator, which holds the whole gallery's numbers, scores matches.  When
+// the gallery is mapped from its file, only this shard's rows are copied and
+// read, so a worker's memory follows its share of the gallery.
+int Trainer::keepShard(int shard, int nShards, std::vector<int> &rows)
+{
+    size_t i;
+
+    rows.clear();
+    for (int f = 0; f < nFaces; f++) {
+        if (personNumTruthMat.at<uint16_t>(f) % nShards == shard)
+            rows.push_back(f);
+    }
+
+    cv::Mat projected(rows.size(), nEigens, CV_32FC1);
+    cv::Mat truth(1, rows.size(), CV_16UC1);
+    for (i = 0; i < rows.size(); i++) {
+        cv::Mat row = projected.row(i);
+        projectedTrainFaceMat.row(rows[i]).copyTo(row);
+        truth.at<uint16_t>(i) = personNumTruthMat.at<uint16_t>(rows[i]);
+    }
+    projectedTrainFaceMat = projected;
+    personNumTruthMat = truth;
+    faceImages.clear();
+    unmapGallery();
+    nFaces = rows.size();
+    scoreOnly = false;
+    prepareSearch();
+    return nFaces;
+}
+
+// Free the projected training faces once worker processes hold them, as a
+// sharded gallery's coordinator does.  What scores a match stays: the
+// eigenbasis, the person numbers and the gallery and watchlist statistics.
+// The local gallery can't be searched afterwards.
+void Trainer::dropGallery(void)
+{
+    size_t i;
+
+    projectedTrainFaceMat.release();
+    orderedTrainFaceMat.release();
+    faceImages.clear();
+    unmapPack();
+    unmapGallery();
+    for (i = 0; i < watchlists.size(); i++) {
+        watchlists[i]->projected.release();
+        watchlists[i]->ordered.release();
+    }
+}
+
+// Precompute what the searches need beyond computeGalleryStats().  The
+// pruned search wants the dimensions ordered by how much they add to a
+// distance on average, so partial sums grow as fast as possible.
+void Trainer::prepareSearch(void)
+{
+    int i, j;
+    const double *m2 = (const double *)galleryM2.data;
+
+    if (searchMode != SEARCH_PRUNED || scoreOnly) {
+        orderedTrainFaceMat.release();
+        for (i = 0; i < (int)watchlists.size(); i++)
+            buildWatchlist(watchlists[i]);
+        return;
+    }
+
+    const float *eigenvalues = (const float *)pca->eigenvalues.data;
+    std::vector<std::pair<double, int> > contribution(nEigens);
+    for (j = 0; j < nEigens; j++)
+        contribution[j] = std::make_pair(m2[j] * distTerm(1, eigenvalues[j]), j);
+    std::stable_sort(contribution.begin(), contribution.end(), contributionGreater);
+
+    searchOrder.create(1, nEigens, CV_32SC1);
+    searchEigenvalues.create(1, nEigens, CV_32FC1);
+    for (j = 0; j < nEigens; j++) {
+        searchOrder.at<int>(j) = contribution[j].second;
+        searchEigenvalues.at<float>(j) = eigenvalues[contribution[j].second];
+    }
+    orderedTrainFaceMat.create(nFaces, nEigens, CV_32FC1);
+    for (i = 0; i < nFaces; i++) {
+        const float *src = projectedTrainFaceMat.ptr<float>(i);
+        float *dst = orderedTrainFaceMat.ptr<float>(i);
+        for (j = 0; j < nEigens; j++)
+            dst[j] = src[contribution[j].second];
+    }
+    for (i = 0; i < (int)watchlists.size(); i++)
+        buildWatchlist(watchlists[i]);
+}
+
+// Copy the listed people's faces out of the gallery.  Called again by
+// prepareSearch() whenever the gallery or the search mode changes.
+void Trainer::buildWatchlist(watchlist *wl)
+{
+    std::vector<int> rows;
+    size_t i;
+
+    if (!pca)
+        return;
+    for (int f = 0; f < nFaces; f++) {
+        int pid = personNumTruthMat.at<uint16_t>(f);
+        if (std::find(wl->persons.begin(), wl->persons.end(), pid) != wl->persons.end())
+            rows.push_back(f);
+    }
+    wl->nFaces = rows.size();
+    wl->index.create(1, wl->nFaces, CV_32SC1);
+    wl->projected.create(wl->nFaces, nEigens, CV_32FC1);
+    if (searchMode == SEARCH_PRUNED && !scoreOnly)
+        wl->ordered.create(wl->nFaces, nEigens, CV_32FC1);
+    else
+        wl->ordered.release();
+    for (i = 0; i < rows.size(); i++) {
+        cv::Mat dst = wl->projected.row(i);
+        wl->index.at<int>(i) = rows[i];
+        projectedTrainFaceMat.row(rows[i]).copyTo(dst);
+        if (searchMode == SEARCH_PRUNED && !scoreOnly) {
+            dst = wl->ordered.row(i);
+            orderedTrainFaceMat.row(rows[i]).copyTo(dst);
+        }
+    }
+    galleryMoments(wl->projected, wl->mean, wl->m2);
+    // Scoring only needs the list's statistics.
+    if (scoreOnly)
+        wl->projected.release();
+}
+
+// Add a list of person ids, returning its number of training faces.  The
+// faces are copied out now if a model is loaded, or when one is.
+int Trainer::addWatchlist(const char *name, const std::vector<int> &persons)
+{
+    watchlist *wl = NULL;
+
+    for (size_t i = 0; i < watchlists.size(); i++) {
+        if (watchlists[i]->name == name)
+            wl = watchlists[i];
+    }
+    if (wl == activeList && wl) {
+        fprintf(stderr, "Can't change watchlist %s while it is in use\n", name);
+        return -1;
+    }
+    if (!wl) {
+        wl = new watchlist;
+        wl->name = name;
+        wl->nFaces = 0;
+        watchlists.push_back(wl);
+    }
+    wl->persons = persons;
+    buildWatchlist(wl);
+    return wl->nFaces;
+}
+
+// Read watchlists from a text file of "list,person name" lines, so that one
+// person can be on several lists.  Returns the number of lists, or -1.
+int Trainer::loadWatchlists(const char *filename)
+{
+    std::map<std::string, std::vector<int> > lists;
+    std::map<std::string, std::vector<int> >::iterator it;
+    FILE *fp;
+    char linebuf[256];
+
+    if (!(fp = fopen(filename, "r"))) {
+        fprintf(stderr, "Can\'t open file %s\n", filename);
+        return -1;
+    }
+    while (fgets(linebuf, sizeof(linebuf), fp)) {
+        char *personName = linebuf;
+        linebuf[strcspn(linebuf, "\r\n")] = '\0';
+        strsep(&personName, ",");
+        if (!personName || !*linebuf)
+            continue;
+        int pid = get_person_index(personName);
+        if (pid < 0) {
+            fprintf(stderr, "Watchlist %s: unknown person '%s'\n", linebuf, personName);
+            continue;
+        }
+        lists[linebuf].push_back(pid);
+    }
+    fclose(fp);
+
+    for (it = lists.begin(); it != lists.end(); it++) {
+        int faces = addWatchlist(it->first.c_str(), it->second);
+        if (faces < 0)
+            return -1;
+        printf("Watchlist %s: %zu people", it->first.c_str(), it->second.size());
+        if (pca)
+            printf(", %d training faces", faces);
+        printf("\n");
+    }
+    return lists.size();
+}
+
+// Make later searches look only at the named list, or at everyone if name
+// is NULL.  Safe to call while other threads are recognizing.
+int Trainer::useWatchlist(const char *name)
+{
+    watchlist *wl = NULL;
+
+    if (name) {
+        for (size_t i = 0; i < watchlists.size() && !wl; i++) {
+            if (watchlists[i]->name == name)
+                wl = watchlists[i];
+        }
+        if (!wl) {
+            fprintf(stderr, "No watchlist named %s\n", name);
+            return -1;
+        }
+    }
+    __atomic_store_n(&activeList, wl, __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -140,6 +567,178 @@ int Trainer::loadImagesFromDb(void)
     return 0;
 }
 
+// Packed face file: a header, the person number of every face, then the
+// 8-bit pixels of all faces back to back.  The pixel block is laid out like
+// an nFaces x (width*height) matrix, so it can be mapped and used directly.
+#define PACK_MAGIC "FACEPAK1"
+
+typedef struct {
+    char magic[8];
+    uint32_t width, height;
+    uint32_t count;
+    uint32_t dataOffset;    // start of the pixel block, from the file start
+} pack_header;
+
+void Trainer::unmapPack(void)
+{
+    if (packMap)
+        munmap(packMap, packMapLen);
+    packMap = NULL;
+    packMapLen = 0;
+}
+
+// Map a packed face file and point faceImages at the records in place, with
+// no per-image open or decode.
+int Trainer::loadImagesFromPack(const char *packfile)
+{
+    const pack_header *hdr;
+    const uint32_t *pids;
+    struct stat st;
+    int fd, i;
+
+    fd = open(packfile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can\'t open packed faces '%s'\n", packfile);
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(pack_header)) {
+        fprintf(stderr, "Packed faces '%s' is truncated\n", packfile);
+        close(fd);
+        return -1;
+    }
+    unmapPack();
+    faceImages.clear();
+    packMapLen = st.st_size;
+    packMap = mmap(NULL, packMapLen, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (packMap == MAP_FAILED) {
+        packMap = NULL;
+        perror("mmap");
+        return -1;
+    }
+    madvise(packMap, packMapLen, MADV_SEQUENTIAL);
+
+    hdr = (const pack_header *)packMap;
+    size_t area = (size_t)hdr->width * hdr->height;
+    // The person numbers must fit before the pixels, and the pixels in the
+    // file; divide rather than multiply so a bad count can't wrap around.
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) || area == 0 ||
+        hdr->count > (packMapLen - sizeof(pack_header)) / sizeof(uint32_t) ||
+        sizeof(pack_header) + hdr->count * sizeof(uint32_t) > hdr->dataOffset ||
+        hdr->dataOffset > packMapLen ||
+        hdr->count > (packMapLen - hdr->dataOffset) / area) {
+        fprintf(stderr, "'%s' is not a valid packed face file\n", packfile);
+        unmapPack();
+        return -1;
+    }
+
+    nFaces = hdr->count;
+    personNumTruthMat.create(1, nFaces, CV_16UC1);
+    pids = (const uint32_t *)(hdr + 1);
+    unsigned char *pixels = (unsigned char *)packMap + hdr->dataOffset;
+    for (i = 0; i < nFaces; i++) {
+        personNumTruthMat.at<uint16_t>(i) = pids[i];
+        faceImages.push_back(cv::Mat(hdr->height, hdr->width, CV_8UC1, pixels + area * i));
+    }
+    return 0;
+}
+
+// Write every picture in the database to a packed face file.
+int Trainer::packFaces(const char *packfile)
+{
+    pack_header hdr;
+    FILE *fp;
+    int i;
+
+    if (loadImagesFromDb()) {
+        printf("Failed to load images from database\n");
+        return -1;
+    }
+    if (nFaces < 1) {
+        fprintf(stderr, "No pictures to pack\n");
+        return -1;
+    }
+    cv::Size size = faceImages[0].size();
+    for (i = 0; i < nFaces; i++) {
+        if (faceImages[i].size() != size) {
+            fprintf(stderr, "Picture %d is %dx%d, expected %dx%d\n", i,
+                    faceImages[i].cols, faceImages[i].rows, size.width, size.height);
+            return -1;
+        }
+    }
+
+    if (!(fp = fopen(packfile, "wb"))) {
+        fprintf(stderr, "Can\'t open file %s\n", packfile);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.width = size.width;
+    hdr.height = size.height;
+    hdr.count = nFaces;
+    // Page-align the pixels so the mapping starts on a fresh page.
+    hdr.dataOffset = (sizeof(hdr) + nFaces * sizeof(uint32_t) + 4095) & ~4095;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for (i = 0; i < nFaces; i++) {
+        uint32_t pid = personNumTruthMat.at<uint16_t>(i);
+        fwrite(&pid, sizeof(pid), 1, fp);
+    }
+    fseek(fp, hdr.dataOffset, SEEK_SET);
+    for (i = 0; i < nFaces; i++) {
+        cv::Mat face = faceImages[i].isContinuous() ? faceImages[i] : faceImages[i].clone();
+        fwrite(face.data, 1, size.area(), fp);
+    }
+    if (fclose(fp)) {
+        perror(packfile);
+        return -1;
+    }
+    printf("Packed %d %dx%d faces into %s\n", nFaces, size.width, size.height, packfile);
+    return 0;
+}
+
+// Write a packed face file back out as one image per face, plus a list in
+// the format loadDbFromList reads.
+int Trainer::unpackFaces(const char *packfile, const char *dir, const char *listfile)
+{
+    FILE *fp;
+    int i;
+
+    if (loadImagesFromPack(packfile))
+        return -1;
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Can't create directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (!(fp = fopen(listfile, "w"))) {
+        fprintf(stderr, "Can\'t open file %s\n", listfile);
+        return -1;
+    }
+    for (i = 0; i < nFaces; i++) {
+        int pid = personNumTruthMat.at<uint16_t>(i);
+        char filename[PATH_MAX];
+        char *name = get_name(pid);
+
+        // A made-up name would enroll the faces as someone new on reload.
+        if (!name) {
+            fprintf(stderr, "No name in the database for person %d\n", pid);
+            fclose(fp);
+            return -1;
+        }
+        snprintf(filename, sizeof(filename), "%s/%d_%d.bmp", dir, pid, i);
+        if (!cv::imwrite(filename, faceImages[i])) {
+            fprintf(stderr, "Can\'t write %s\n", filename);
+            free(name);
+            fclose(fp);
+            return -1;
+        }
+        fprintf(fp, "%d,%s,%s\n", pid, name, filename);
+        free(name);
+    }
+    fclose(fp);
+    printf("Unpacked %d faces from %s into %s\n", nFaces, packfile, dir);
+    return 0;
+}
+
 // Do the Principal Component Analysis, finding the average image
 // and the eigenfaces that represent any image in the given dataset.
 void Trainer::doPCA(void)
@@ -205,6 +804,109 @@ void Trainer::storeEigenfaceImages(void)
 }
 
 // Open the training data from the file
+// The projected training faces are kept beside the model in a file of
+// their own, a header and then the nFaces x nEigens floats, so they can be
+// mapped rather than parsed: a process only pays for the rows it reads.
+#define GALLERY_MAGIC "FACEGAL1"
+
+typedef struct {
+    char magic[8];
+    uint32_t rows, cols;
+    uint32_t dataOffset;    // start of the rows, from the file start
+} gallery_header;
+
+static std::string galleryPath(const char *filename)
+{
+    return std::string(filename) + ".gallery";
+}
+
+// Point projectedTrainFaceMat at the rows of a gallery file, read-only and
+// without copying them.
+int Trainer::mapGallery(const char *galleryfile)
+{
+    const gallery_header *hdr;
+    struct stat st;
+    int fd;
+
+    fd = open(galleryfile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can\'t open gallery '%s'\n", galleryfile);
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(gallery_header)) {
+        fprintf(stderr, "Gallery '%s' is truncated\n", galleryfile);
+        close(fd);
+        return -1;
+    }
+    projectedTrainFaceMat.release();
+    unmapGallery();
+    galleryMapLen = st.st_size;
+    galleryMap = mmap(NULL, galleryMapLen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (galleryMap == MAP_FAILED) {
+        galleryMap = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    hdr = (const gallery_header *)galleryMap;
+    size_t rowLen = (size_t)hdr->cols * sizeof(float);
+    if (memcmp(hdr->magic, GALLERY_MAGIC, sizeof(hdr->magic)) ||
+        (int)hdr->rows != nFaces || (int)hdr->cols != nEigens || rowLen == 0 ||
+        hdr->dataOffset < sizeof(gallery_header) || hdr->dataOffset > galleryMapLen ||
+        hdr->rows > (galleryMapLen - hdr->dataOffset) / rowLen) {
+        fprintf(stderr, "'%s' is not the gallery of this model\n", galleryfile);
+        unmapGallery();
+        return -1;
+    }
+    projectedTrainFaceMat = cv::Mat(hdr->rows, hdr->cols, CV_32FC1,
+                                    (char *)galleryMap + hdr->dataOffset);
+    return 0;
+}
+
+// Callers let go of any view of the rows first.
+void Trainer::unmapGallery(void)
+{
+    if (galleryMap)
+        munmap(galleryMap, galleryMapLen);
+    galleryMap = NULL;
+    galleryMapLen = 0;
+}
+
+// Written to a temporary name and renamed over the old file, so a process
+// that still has the old one mapped keeps reading it intact.
+static int storeGallery(const char *galleryfile, const cv::Mat &projected)
+{
+    std::string tmpfile = std::string(galleryfile) + ".tmp";
+    gallery_header hdr;
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(tmpfile.c_str(), "wb"))) {
+        fprintf(stderr, "Can\'t open file %s\n", tmpfile.c_str());
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, GALLERY_MAGIC, sizeof(hdr.magic));
+    hdr.rows = projected.rows;
+    hdr.cols = projected.cols;
+    // Page-align the rows so the mapping starts on a fresh page.
+    hdr.dataOffset = (sizeof(hdr) + 4095) & ~4095;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fseek(fp, hdr.dataOffset, SEEK_SET);
+    for (i = 0; i < projected.rows; i++)
+        fwrite(projected.ptr<float>(i), sizeof(float), projected.cols, fp);
+    bool failed = ferror(fp);
+    if (fclose(fp))
+        failed = true;
+    if (failed || rename(tmpfile.c_str(), galleryfile)) {
+        perror(galleryfile);
+        unlink(tmpfile.c_str());
+        return -1;
+    }
+    return 0;
+}
+
 int Trainer::loadTrainingData(const char *filename)
 {
     cv::FileStorage fs;
@@ -219,12 +921,24 @@ int Trainer::loadTrainingData(const char *filename)
     fs["eigenvals"] >> pca->eigenvalues;
     fs["eigenvects"] >> pca->eigenvectors;
     fs["mean"] >> pca->mean;
-    fs["projectedTrainFaceMat"] >> projectedTrainFaceMat;
     fs["personNumTruthMat"] >> personNumTruthMat;
     fs["nEigens"] >> nEigens;
     fs["nFaces"] >> nFaces;
+    // Older models carry the projected faces inline, and are read whole.
+    bool inlineGallery = !fs["projectedTrainFaceMat"].empty();
+    if (inlineGallery)
+        fs["projectedTrainFaceMat"] >> projectedTrainFaceMat;
     fs["faceSizeW"] >> faceSize.width;
     fs["faceSizeH"] >> faceSize.height;
+    // Older models don't carry the confidence statistics.
+    bool haveStats = !fs["impostorDists"].empty();
+    if (haveStats) {
+        fs["galleryMean"] >> galleryMean;
+        fs["galleryM2"] >> galleryM2;
+        fs["impostorDists"] >> impostorDists;
+        fs["confScale"] >> confScale;
+        fs["confOffset"] >> confOffset;
+    }
     //for(int i=0; i<nEigens; i++) {
     //    char varname[200];
     //    sprintf( varname, "eigenVect_%d", i );
@@ -234,6 +948,11 @@ int Trainer::loadTrainingData(const char *filename)
     // release the file-storage interface
     fs.release();
 
+    if (!inlineGallery && mapGallery(galleryPath(filename).c_str()))
+        return -1;
+    if (!haveStats)
+        computeGalleryStats();
+    prepareSearch();
     printf("Training data loaded (%d training images):\n", nFaces);
     return 0;
 }
@@ -252,12 +971,16 @@ int Trainer::storeTrainingData(const char *filename)
     fs << "eigenvals" << pca->eigenvalues;
     fs << "eigenvects" << pca->eigenvectors;
     fs << "mean" << pca->mean;
-    fs << "projectedTrainFaceMat" << projectedTrainFaceMat;
     fs << "personNumTruthMat" << personNumTruthMat;
     fs << "nEigens" << nEigens;
     fs << "nFaces" << nFaces;
     fs << "faceSizeW" << faceSize.width;
     fs << "faceSizeH" << faceSize.height;
+    fs << "galleryMean" << galleryMean;
+    fs << "galleryM2" << galleryM2;
+    fs << "impostorDists" << impostorDists;
+    fs << "confScale" << confScale;
+    fs << "confOffset" << confOffset;
     //for(int i=0; i<nEigens; i++) {
         //char varname[200];
         //sprintf( varname, "eigenVect_%d", i );
@@ -266,7 +989,7 @@ int Trainer::storeTrainingData(const char *filename)
 
     // release the file-storage interface
     fs.release();
-    return 0;
+    return storeGallery(galleryPath(filename).c_str(), projectedTrainFaceMat);
 }
 
 // Returns the name corresponding to the person index.  String must be freed.
@@ -274,6 +997,11 @@ char *Trainer::get_name(int index)
 {
     sqlite3_stmt *pstmt;
     char *name;
+    std::map<int, std::string>::iterator it = names.find(index);
+
+    // People enrolled since the cache was filled fall through to the db.
+    if (it != names.end())
+        return strdup(it->second.c_str());
     int ret = sqlite3_prepare_v2(db, "SELECT name from names WHERE id = ?;",
                                  -1, &pstmt, NULL);
     RET_CHECK_NULL(ret);
@@ -289,6 +1017,55 @@ char *Trainer::get_name(int index)
     return name;
 }
 
+// Read the whole names table into memory, so looking up who was recognized
+// doesn't go to SQLite on every frame.  Call before recognizing starts; the
+// cache is only read after that.  Returns the number of names.
+int Trainer::cacheNames(void)
+{
+    sqlite3_stmt *pstmt;
+    int ret = sqlite3_prepare_v2(db, "SELECT id, name FROM names;",
+                                 -1, &pstmt, NULL);
+    RET_CHECK(ret);
+    names.clear();
+    while (sqlite3_step(pstmt) == SQLITE_ROW) {
+        names[sqlite3_column_int(pstmt, 0)] =
+            std::string((const char *)sqlite3_column_text(pstmt, 1));
+    }
+    ret = sqlite3_finalize(pstmt);
+    RET_CHECK(ret);
+    return names.size();
+}
+
+static volatile float prefaultSink;
+
+// Read every page of what a query touches, so the first frames don't pay for
+// page faults or cold caches on a large model.
+static void touchPages(const cv::Mat &m)
+{
+    const long page = sysconf(_SC_PAGESIZE);
+    size_t len = m.total() * m.elemSize();
+    float sum = 0;
+
+    if (m.empty())
+        return;
+    for (size_t off = 0; off < len; off += page)
+        sum += m.data[off];
+    prefaultSink = sum;
+}
+
+void Trainer::prefault(void)
+{
+    touchPages(pca->eigenvectors);
+    touchPages(pca->mean);
+    touchPages(projectedTrainFaceMat);
+    touchPages(orderedTrainFaceMat);
+    touchPages(personNumTruthMat);
+    for (size_t i = 0; i < watchlists.size(); i++) {
+        touchPages(watchlists[i]->projected);
+        touchPages(watchlists[i]->ordered);
+    }
+}
+
 int Trainer::get_pictures(picture_cb cb, void *data)
 {
     sqlite3_stmt *pstmt;
@@ -309,21 +1086,29 @@ int Trainer::get_pictures(picture_cb cb, void *data)
     return 0;
 }
 
+// Where to save a new picture of name under dir, under a name no other save,
+// from any thread or process, can take.  A '/' in the name would reach
+// outside dir, so it is replaced.
+std::string faceFilename(const char *dir, const char *name)
+{
+    static int seq = 0;
+    char suffix[64];
+
+    std::string base = name;
+    std::replace(base.begin(), base.end(), '/', '_');
+    snprintf(suffix, sizeof(suffix), "-%ld-%d-%d.pgm", (long)time(NULL), (int)getpid(),
+             __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+    return std::string(dir) + "/" + base + suffix;
+}
+
 int Trainer::add_training_face(const char *name, const cv::Mat &img)
 {
-    const char *base = "data/";
-    const char *ext = ".bmp";
-    char *filename = (char *) malloc(strlen(base) + strlen(name) + strlen(ext) + 1);
+    std::string filename = faceFilename("data", name);
     int ret;
 
-    if (!filename)
+    if (!cv::imwrite(filename, img))
         return -1;
-    strcat(filename, base);
-    strcat(filename + strlen(filename), name);
-    strcat(filename + strlen(filename), ext);
-
-    cv::imwrite(filename, img);
-    ret = db_add_picture(name, filename);
+    ret = db_add_picture(name, filename.c_str());
     if (ret) return ret;
     return 0;
 }
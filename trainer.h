@@ -1,8 +1,56 @@
+#ifndef __trainer_h__
+#define __trainer_h__
+
+#include <map>
+#include <string>
+#include <vector>
 #include <opencv2/opencv.hpp>
 #include <sqlite3.h>
 
+// Mahalanobis distance (might give better results than Euclidean distance)
+#define USE_MAHALANOBIS_DISTANCE
+
+// One dimension's share of a squared distance, for a difference of d along
+// an eigenvector with the given eigenvalue.  distTerm(1, eigenvalue) is the
+// weight of that dimension.
+static inline double distTerm(float d, float eigenvalue)
+{
+#ifdef USE_MAHALANOBIS_DISTANCE
+    return d*d / eigenvalue;
+#else
+    return d*d;
+#endif
+}
+
+// How findNearestNeighbor walks the gallery.
+enum {
+    SEARCH_FULL,        // every dimension of every training face
+    SEARCH_PRUNED,      // early-abandon partial distances, same result as SEARCH_FULL
+};
+
+// How findNearestNeighbor turns the nearest distance into a confidence.
+enum {
+    CONFIDENCE_GALLERY,     // relative to this query's average distance to the gallery
+    CONFIDENCE_IMPOSTOR,    // against the train-time nearest-impostor distances
+};
+
+// A named subset of the enrolled people.  Its training faces are copied out
+// into a gallery of their own, so searching the list costs in proportion to
+// the list rather than the whole model.
+typedef struct {
+    std::string name;
+    std::vector<int> persons;   // person ids on the list
+    int nFaces;
+    cv::Mat index;              // row in projectedTrainFaceMat of each face
+    cv::Mat projected;          // those rows of projectedTrainFaceMat
+    cv::Mat ordered;            // and of orderedTrainFaceMat, for SEARCH_PRUNED
+    cv::Mat mean, m2;           // gallery statistics over the list
+} watchlist;
+
 typedef int(*picture_cb)(int index, const char *filename, void *data);
 
+std::string faceFilename(const char *dir, const char *name);
+
 class Trainer {
     public:
         Trainer(const char *dbfile);
@@ -13,22 +61,72 @@ class Trainer {
         int loadTrainingData(const char *filename);
         int storeTrainingData(const char *filename);
         char *get_name(int index);
+        int cacheNames(void);
+        void prefault(void);
         int get_pictures(picture_cb cb, void *data);
         int add_training_face(const char *name, const cv::Mat &img);
+        int packFaces(const char *packfile);
+        int unpackFaces(const char *packfile, const char *dir, const char *listfile);
+        void setPackFile(const char *packfile) { packname = packfile; }
+        void setScoreOnly(bool on) { scoreOnly = on; }
+        void setSearchMode(int mode);
+        void prepareSearch(void);
+        void computeGalleryStats(void);
+        int condense(float threshold, int cap);
+        int keepShard(int shard, int nShards, std::vector<int> &rows);
+        void dropGallery(void);
+        int addWatchlist(const char *name, const std::vector<int> &persons);
+        int loadWatchlists(const char *filename);
+        int useWatchlist(const char *name);
+        watchlist *activeWatchlist(void) { return __atomic_load_n(&activeList, __ATOMIC_ACQUIRE); }
 
         int nEigens, nFaces;
         cv::Mat personNumTruthMat; // 1d array mapping picture indexes to person numbers
         cv::Mat projectedTrainFaceMat; // projected training faces
         cv::Size faceSize;
         cv::PCA *pca;
+
+        // Search state derived from the model by prepareSearch()
+        int searchMode;
+        int voteK;                      // decide by a vote of the voteK nearest faces, if > 1
+        cv::Mat searchOrder;            // dimensions by decreasing contribution
+        cv::Mat searchEigenvalues;      // eigenvalues in searchOrder
+        cv::Mat orderedTrainFaceMat;    // projectedTrainFaceMat with columns in searchOrder
+
+        // Confidence statistics, computed at train time and kept in the model
+        int confidenceMode;
+        cv::Mat galleryMean;            // per-dimension mean of projectedTrainFaceMat
+        cv::Mat galleryM2;              // per-dimension sum of squared deviations from it
+        cv::Mat impostorDists;          // sorted distances from faces to their nearest other person
+        float confScale, confOffset;    // maps the impostor score onto the gallery score
+
+        // Searches only look at the active list, or everyone if it is NULL.
+        // Lists are built up front, so switching is just a pointer swap.
+        std::vector<watchlist *> watchlists;
+
+        // Only score matches others searched for, as a sharded gallery's
+        // coordinator does: no search copies of the gallery are made.
+        bool scoreOnly;
     private:
         const char *dbname;
         sqlite3 *db;
         int nPersons;
         std::vector<cv::Mat> faceImages;
+        const char *packname;   // learn from this packed face file instead of the db
+        void *packMap;
+        size_t packMapLen;
+        void *galleryMap;       // the model's gallery file, if it has one
+        size_t galleryMapLen;
+        watchlist *activeList;
+        std::map<int, std::string> names;   // names table, once cacheNames() has run
 
         int loadImagesFromDb(void);
+        int loadImagesFromPack(const char *packfile);
+        void unmapPack(void);
+        int mapGallery(const char *galleryfile);
+        void unmapGallery(void);
         void doPCA(void);
+        void buildWatchlist(watchlist *wl);
 
         int opendb(void);
         int set_sync(void);
@@ -41,3 +139,5 @@ class Trainer {
         int create_tables(void);
         int check_table_init(void);
 };
+
+#endif
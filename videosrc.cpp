@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "framefile.h"
+#include "shmring.h"
+#include "videosrc.h"
+
+// Open a --videosrc argument.  A leading digit selects a camera device,
+// "replay:file" plays a recorded session at its recorded pace and
+// "replayfast:file" as fast as possible, and "shm:name" attaches to a frame
+// ring from 'recognize publish'.  Anything else is handed to OpenCV
+// as a file name or stream URL.  Returns NULL if the source can't be opened.
+cv::VideoCapture *openVideoSource(const char *src)
+{
+    cv::VideoCapture *cap;
+
+    if (strncmp(src, "replay:", 7) == 0 || strncmp(src, "replayfast:", 11) == 0) {
+        ReplayCapture *replay = new ReplayCapture();
+        bool paced = src[6] == ':';
+        if (!replay->openReplay(strchr(src, ':') + 1, paced)) {
+            delete replay;
+            return NULL;
+        }
+        return replay;
+    }
+
+    if (strncmp(src, "shm:", 4) == 0) {
+        ShmCapture *shm = new ShmCapture();
+        if (!shm->openShm(src + 4)) {
+            delete shm;
+            return NULL;
+        }
+        return shm;
+    }
+
+    cap = new cv::VideoCapture();
+
+    if (src[0] >= '0' && src[0] <= '9') {
+        int cam_num = strtol(src, NULL, 10);
+        cap->open(cam_num);
+    } else {
+        cap->open(src);
+    }
+    if (!cap->isOpened()) {
+        delete cap;
+        return NULL;
+    }
+    return cap;
+}
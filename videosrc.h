@@ -0,0 +1,8 @@
+#ifndef __videosrc_h__
+#define __videosrc_h__
+
+#include <opencv2/opencv.hpp>
+
+cv::VideoCapture *openVideoSource(const char *src);
+
+#endif
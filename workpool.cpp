@@ -0,0 +1,155 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "workpool.h"
+
+WorkPool::WorkPool(int n) : nthreads(n > 0 ? n : cpuCount())
+{
+    int i;
+
+    queued = 0;
+    pending = 0;
+    next = 0;
+    stopping = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&work_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        work_queue *q = new work_queue;
+        pthread_mutex_init(&q->lock, NULL);
+        queues.push_back(q);
+    }
+    args.resize(nthreads);
+    threads.resize(nthreads);
+    for (i = 0; i < nthreads; i++) {
+        args[i].pool = this;
+        args[i].index = i;
+        if (pthread_create(&threads[i], NULL, thread_main, &args[i])) {
+            fprintf(stderr, "Failed to start worker thread %d\n", i);
+            exit(1);
+        }
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&queues[i]->lock);
+        delete queues[i];
+    }
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&work_cond);
+    pthread_mutex_destroy(&lock);
+}
+
+int WorkPool::cpuCount(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void WorkPool::submit(work_fn fn, void *arg)
+{
+    work_item item;
+    work_queue *q;
+
+    item.fn = fn;
+    item.arg = arg;
+
+    pthread_mutex_lock(&lock);
+    q = queues[next];
+    next = (next + 1) % nthreads;
+    pending++;
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_lock(&q->lock);
+    q->items.push_back(item);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&lock);
+    queued++;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// Block until everything submitted so far has finished.
+void WorkPool::wait(void)
+{
+    pthread_mutex_lock(&lock);
+    while (pending > 0)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+bool WorkPool::take(int self, work_item *item)
+{
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+        int victim = (self + i) % nthreads;
+        work_queue *q = queues[victim];
+        bool found = false;
+
+        pthread_mutex_lock(&q->lock);
+        if (!q->items.empty()) {
+            // Own work is LIFO for locality, stolen work is FIFO.
+            if (victim == self) {
+                *item = q->items.back();
+                q->items.pop_back();
+            } else {
+                *item = q->items.front();
+                q->items.pop_front();
+            }
+            found = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (found) {
+            pthread_mutex_lock(&lock);
+            queued--;
+            pthread_mutex_unlock(&lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::run(int self)
+{
+    work_item item;
+
+    while (1) {
+        if (take(self, &item)) {
+            item.fn(item.arg, self);
+            pthread_mutex_lock(&lock);
+            if (--pending == 0)
+                pthread_cond_broadcast(&done_cond);
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        while (queued <= 0 && !stopping)
+            pthread_cond_wait(&work_cond, &lock);
+        if (queued <= 0 && stopping) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void *WorkPool::thread_main(void *arg)
+{
+    worker_arg *wa = (worker_arg *)arg;
+    wa->pool->run(wa->index);
+    return NULL;
+}
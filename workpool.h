@@ -0,0 +1,55 @@
+#ifndef __workpool_h__
+#define __workpool_h__
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+// worker is the index of the thread running the item, 0 <= worker < size(),
+// so callers can keep per-thread state (cascades, buffers) in plain arrays.
+typedef void(*work_fn)(void *arg, int worker);
+
+typedef struct {
+    work_fn fn;
+    void *arg;
+} work_item;
+
+// A fixed set of worker threads, each with its own deque.  Work is dealt out
+// round-robin; a worker pops from the back of its own deque and, once that is
+// empty, steals from the front of the others.
+class WorkPool {
+    public:
+        WorkPool(int nthreads);
+        ~WorkPool();
+        void submit(work_fn fn, void *arg);
+        void wait(void);
+        int size(void) { return nthreads; }
+        static int cpuCount(void);
+    private:
+        typedef struct {
+            pthread_mutex_t lock;
+            std::deque<work_item> items;
+        } work_queue;
+        typedef struct {
+            WorkPool *pool;
+            int index;
+        } worker_arg;
+
+        int nthreads;
+        std::vector<pthread_t> threads;
+        std::vector<work_queue *> queues;
+        std::vector<worker_arg> args;
+        pthread_mutex_t lock;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        int queued;     // items sitting in a deque
+        int pending;    // items submitted and not yet finished
+        int next;
+        bool stopping;
+
+        bool take(int self, work_item *item);
+        void run(int self);
+        static void *thread_main(void *arg);
+};
+
+#endif